@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "memcpy_sse2.h"
+#include "arena.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+#define _ROUND(n) (((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+
+static arenachunk_t *_chunk_new(const size_t size)
+{
+  size_t cap = size > ARENA_CHUNK ? _ROUND(size) : ARENA_CHUNK;
+  arenachunk_t *chunk = malloc(sizeof(struct _arenachunk) + cap);
+  if (!chunk) return NULL;
+  chunk->next = NULL;
+  chunk->size = cap;
+  chunk->used = 0;
+  return chunk;
+}
+
+/* the arena lives at the start of its first chunk, size bytes follow it */
+arena_t *arena_new(const size_t size)
+{
+  size_t self = _ROUND(sizeof(struct _arena));
+  arenachunk_t *chunk = _chunk_new(self + size);
+  if (!chunk) return NULL;
+
+  arena_t *arena = (arena_t *)chunk->data;
+  chunk->used = self;
+  arena->head = chunk;
+  return arena;
+}
+
+void arena_destroy(arena_t *arena)
+{
+  arenachunk_t *chunk = arena->head;
+  arenachunk_t *next;
+
+  /* the first chunk holds the arena, it goes last */
+  while (chunk) {
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+/* the first chunk is kept for the next request, the others are freed */
+void arena_reset(arena_t *arena)
+{
+  arenachunk_t *chunk = arena->head;
+  arenachunk_t *next;
+
+  while (chunk->next) {
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  chunk->used = _ROUND(sizeof(struct _arena));
+  arena->head = chunk;
+}
+
+void *arena_alloc(arena_t *arena,
+                  const size_t size)
+{
+  arenachunk_t *chunk = arena->head;
+  size_t n = _ROUND(size);
+
+  if (chunk->size - chunk->used < n) {
+    /* a new chunk at the head, the old ones stay until the end */
+    chunk = _chunk_new(n);
+    if (!chunk) return NULL;
+    chunk->next = arena->head;
+    arena->head = chunk;
+    D_PRINT("[ARENA] new chunk of %lu\n", chunk->size);
+  }
+  void *ptr = chunk->data + chunk->used;
+  chunk->used += n;
+  return ptr;
+}
+
+/* the last allocation grows in place if its chunk has room */
+void *arena_realloc(arena_t *arena,
+                    void *ptr,
+                    const size_t old_size,
+                    const size_t size)
+{
+  arenachunk_t *chunk = arena->head;
+  size_t old = _ROUND(old_size);
+
+  if (ptr && (char *)ptr + old == chunk->data + chunk->used &&
+      chunk->used - old + _ROUND(size) <= chunk->size) {
+    chunk->used = chunk->used - old + _ROUND(size);
+    return ptr;
+  }
+
+  void *p = arena_alloc(arena, size);
+  if (p && ptr) memcpy_fast(p, ptr, old_size < size ? old_size : size);
+  return p;
+}
+
+char *arena_strndup(arena_t *arena,
+                    const char *s,
+                    const size_t len)
+{
+  char *p = arena_alloc(arena, len + 1);
+  if (!p) return NULL;
+  memcpy_fast(p, s, len);
+  p[len] = '\0';
+  return p;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+
+#define ARENA_CHUNK 4096  /* bytes, the least a chunk holds */
+#define ARENA_ALIGN 16
+
+
+typedef struct _arenachunk arenachunk_t;
+
+struct _arenachunk {
+  struct _arenachunk *next;
+  size_t size;
+  size_t used;
+  _Alignas(ARENA_ALIGN) char data[];  /* as aligned as the pieces */
+};
+
+/*
+ * a bump allocator for what lives as long as a request: the pieces are
+ * never freed one by one, all of them go at once with arena_reset() or
+ * arena_destroy()
+ */
+typedef struct _arena arena_t;
+
+struct _arena {
+  struct _arenachunk *head;  /* the chunk being filled */
+};
+
+
+arena_t *arena_new(const size_t size);
+
+void arena_destroy(arena_t *arena);
+
+void arena_reset(arena_t *arena);
+
+void *arena_alloc(arena_t *arena,
+                  const size_t size);
+
+void *arena_realloc(arena_t *arena,
+                    void *ptr,
+                    const size_t old_size,
+                    const size_t size);
+
+char *arena_strndup(arena_t *arena,
+                    const char *s,
+                    const size_t len);
+
+
+#endif
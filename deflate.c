@@ -14,6 +14,11 @@
 #include <string.h>
 #include <assert.h> /* assert */
 #include <limits.h> /* CHAR_BIT */
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SDEFL_X86
+#endif
 #include "memcpy_sse2.h"
 #include "deflate.h"
 
@@ -56,6 +61,69 @@ static unsigned _hash32(const void *p)
   return (n * 0x9E377989) >> (32 - SDEFL_HASH_BITS);
 }
 
+/*
+ * match extension: number of equal bytes of a and b, up to max.
+ * all variants return exactly the same length, they only differ in
+ * how many bytes are compared at a time
+ */
+static int _match_len_ref(const unsigned char *a,
+                          const unsigned char *b,
+                          const int max)
+{
+  int n = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (n + 8 <= max) {
+    unsigned long long x, y;
+    memcpy(&x, a + n, 8);
+    memcpy(&y, b + n, 8);
+    if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3);
+    n += 8;
+  }
+#endif
+  while (n < max && a[n] == b[n]) n++;
+  return n;
+}
+
+#ifdef SDEFL_X86
+__attribute__((target("sse2")))
+static int _match_len_sse2(const unsigned char *a,
+                           const unsigned char *b,
+                           const int max)
+{
+  int n = 0;
+  while (n + 16 <= max) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + n));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + n));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+    if (mask) return n + __builtin_ctz(mask);
+    n += 16;
+  }
+  while (n < max && a[n] == b[n]) n++;
+  return n;
+}
+
+__attribute__((target("avx2")))
+static int _match_len_avx2(const unsigned char *a,
+                           const unsigned char *b,
+                           const int max)
+{
+  int n = 0;
+  while (n + 32 <= max) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + n));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + n));
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    if (mask) return n + __builtin_ctz(mask);
+    n += 32;
+  }
+  while (n < max && a[n] == b[n]) n++;
+  return n;
+}
+#endif
+
+static int (*_match_len)(const unsigned char *a,
+                         const unsigned char *b,
+                         const int max) = _match_len_ref;
+
 static void _put(unsigned char **dst,
                  struct sdefl *s,
                  const int code,
@@ -447,7 +515,7 @@ static void _fnd(struct sdefl_match *m,
     if (in[i+m->len] == in[p+m->len] &&
         (_uload32(&in[i]) == _uload32(&in[p]))){
       int n = SDEFL_MIN_MATCH;
-      while (n < max_match && in[i+n] == in[p+n]) n++;
+      n += _match_len(&in[i+n], &in[p+n], max_match - n);
       if (n > m->len) {
         m->len = n, m->off = p - i;
         if (n == max_match) break;
@@ -458,19 +526,35 @@ static void _fnd(struct sdefl_match *m,
   }
 }
 
-static int _compress(struct sdefl *s,
-                     unsigned char *out,
-                     const unsigned char *in,
-                     const int in_len,
-                     const int lvl)
+/*
+ * compress in[dict, in_len), the bytes in[0, dict) are only used as
+ * history (preset dictionary) for the match finder
+ */
+static int _compress_win(struct sdefl *s,
+                         unsigned char *out,
+                         const unsigned char *in,
+                         const int dict,
+                         const int in_len,
+                         const int lvl,
+                         const int is_last)
 {
   unsigned char *q = out;
   static const unsigned char pref[] = {8,10,14,24,30,48,65,96,130};
   int max_chain = (lvl < 8) ? (1 << (lvl + 1)): (1 << 13);
   int n, i = 0, litlen = 0;
+  /* the state may come from the stack, don't count on it being zeroed */
+  s->seq_cnt = 0;
+  memset(&s->freq, 0, sizeof(s->freq));
   for (n = 0; n < SDEFL_HASH_SIZ; ++n) {
     s->tbl[n] = SDEFL_NIL;
   }
+  /* prime the hash chains with the dictionary */
+  for (; i < dict && in_len - i > SDEFL_MIN_MATCH; i++) {
+    unsigned h = _hash32(&in[i]);
+    s->prv[i&SDEFL_WIN_MSK] = s->tbl[h];
+    s->tbl[h] = i;
+  }
+  i = dict;
   do {
     int blk_end = i + SDEFL_BLK_MAX < in_len ? i + SDEFL_BLK_MAX : in_len;
     while (i < blk_end) {
@@ -517,14 +601,37 @@ static int _compress(struct sdefl *s,
       _seq(s, i - litlen, litlen);
       litlen = 0;
     }
-    _flush(&q, s, blk_end == in_len, in);
+    _flush(&q, s, is_last && blk_end == in_len, in);
   } while (i < in_len);
 
-  if (s->bitcnt)
+  if (!is_last) {
+    /*
+     * sync flush: an empty stored block brings the stream to a byte
+     * boundary, so the next chunk can simply be appended (same as pigz)
+     */
+    _put(&q, s, 0x00, 1); /* not last */
+    _put(&q, s, 0x00, 2); /* stored */
+    if (s->bitcnt)
+      _put(&q, s, 0x00, 8 - s->bitcnt);
+    _put(&q, s, 0x00, 8);
+    _put(&q, s, 0x00, 8);
+    _put(&q, s, 0xFF, 8);
+    _put(&q, s, 0xFF, 8);
+  }
+  else if (s->bitcnt)
     _put(&q, s, 0x00, 8 - s->bitcnt);
   return (int)(q - out);
 }
 
+static int _compress(struct sdefl *s,
+                     unsigned char *out,
+                     const unsigned char *in,
+                     const int in_len,
+                     const int lvl)
+{
+  return _compress_win(s, out, in, 0, in_len, lvl, 1);
+}
+
 int deflate(struct sdefl *s,
             void *out,
             const void *in,
@@ -535,17 +642,150 @@ int deflate(struct sdefl *s,
   return _compress(s, (unsigned char *)out, (const unsigned char *)in, n, lvl);
 }
 
-static unsigned _adler32(unsigned adler32,
-                         const unsigned char *in,
-                         int in_len)
+/*
+ * compress a chunk of a stream which is sent as it is produced, every
+ * chunk but the last one ends with a sync flush, so the receiver can
+ * inflate what it has got so far
+ */
+int deflate_chunk(struct sdefl *s,
+                  void *out,
+                  const void *in,
+                  const int n,
+                  const int lvl,
+                  const int is_last)
+{
+  s->bits = s->bitcnt = 0;
+  return _compress_win(s, (unsigned char *)out, (const unsigned char *)in,
+                       0, n, lvl, is_last);
+}
+
+struct sdefl_job {
+  const unsigned char *in;
+  int len;
+  int lvl;
+  int nchunks;
+  volatile int next;          /* next chunk to be picked by a worker */
+  unsigned char **outs;       /* per chunk output */
+  int *lens;                  /* per chunk output length */
+};
+
+static void *_deflate_worker(void *arg)
+{
+  struct sdefl_job *job = (struct sdefl_job *)arg;
+  struct sdefl *s = malloc(sizeof(struct sdefl));
+  if (!s) return NULL;
+
+  do {
+    int c = __sync_fetch_and_add(&job->next, 1);
+    if (c >= job->nchunks) break;
+
+    int start = c * SDEFL_BLK_MAX;
+    int end = start + SDEFL_BLK_MAX < job->len ? start + SDEFL_BLK_MAX
+                                               : job->len;
+    /* prime the window with the previous 32K as the dictionary */
+    int dict = start < SDEFL_WIN_SIZ ? start : SDEFL_WIN_SIZ;
+    const unsigned char *win = job->in + start - dict;
+
+    job->outs[c] = malloc(deflate_bound(end - start) + 8);
+    if (!job->outs[c]) continue;
+    s->bits = s->bitcnt = 0;
+    job->lens[c] = _compress_win(s, job->outs[c], win, dict, end - start + dict,
+                                 job->lvl, c == job->nchunks - 1);
+  } while (1);
+
+  free(s);
+  return NULL;
+}
+
+int deflate_mt(void *out,
+               const void *in,
+               const int n,
+               const int lvl,
+               int nthreads)
+{
+  static volatile int spare = SDEFL_MT_SPARE;
+  struct sdefl_job job;
+  pthread_t tids[SDEFL_MT_MAX];
+  int i, len = 0, nt = 0, held, left;
+
+  job.in = (const unsigned char *)in;
+  job.len = n;
+  job.lvl = lvl;
+  job.nchunks = (n + SDEFL_BLK_MAX - 1) / SDEFL_BLK_MAX;
+  job.next = 0;
+
+  if (nthreads > SDEFL_MT_MAX) nthreads = SDEFL_MT_MAX;
+  if (nthreads > job.nchunks) nthreads = job.nchunks;
+
+  /* the helpers are shared by the requests, take what is left of them */
+  do {
+    left = spare;
+    held = left < nthreads - 1 ? left : nthreads - 1;
+    if (held < 1) {
+      held = 0;
+      break;
+    }
+  } while (!__sync_bool_compare_and_swap(&spare, left, left - held));
+
+  /* not worth the threads, or none to spare, do it inline */
+  if (!held) {
+    struct sdefl *s = malloc(sizeof(struct sdefl));
+    if (!s) return -1;
+    len = deflate(s, out, in, n, lvl);
+    free(s);
+    return len;
+  }
+
+  job.outs = calloc(job.nchunks, sizeof(unsigned char *));
+  job.lens = calloc(job.nchunks, sizeof(int));
+  if (!job.outs || !job.lens) {
+    free(job.outs);
+    free(job.lens);
+    __sync_fetch_and_add(&spare, held);
+    return -1;
+  }
+
+  for (i = 0; i < held; i++) {
+    if (pthread_create(&tids[nt], NULL, _deflate_worker, &job) == 0) nt++;
+  }
+  /* the calling thread works on chunks too */
+  _deflate_worker(&job);
+  for (i = 0; i < nt; i++)
+    pthread_join(tids[i], NULL);
+  __sync_fetch_and_add(&spare, held);
+
+  /* concatenate the byte aligned chunks */
+  unsigned char *q = (unsigned char *)out;
+  for (i = 0; i < job.nchunks; i++) {
+    if (job.outs[i]) {
+      memcpy_fast(q, job.outs[i], job.lens[i]);
+      q += job.lens[i];
+      free(job.outs[i]);
+    }
+    else
+      len = -1;
+  }
+  if (len == 0) len = (int)(q - (unsigned char *)out);
+
+  free(job.outs);
+  free(job.lens);
+  return len;
+}
+
+#define SDEFL_ADLER_INIT (1)
+#define SDEFL_ADLER_MOD  (65521)
+#define SDEFL_ADLER_NMAX (5552)
+
+static unsigned _adler32_ref(unsigned adler32,
+                             const unsigned char *in,
+                             int in_len)
 {
-  #define SDEFL_ADLER_INIT (1)
-  const unsigned ADLER_MOD = 65521;
+  const unsigned ADLER_MOD = SDEFL_ADLER_MOD;
   unsigned s1 = adler32 & 0xffff;
   unsigned s2 = adler32 >> 16;
   unsigned blk_len, i;
 
-  blk_len = in_len % 5552;
+  blk_len = in_len % SDEFL_ADLER_NMAX;
   while (in_len) {
     for (i = 0; i + 7 < blk_len; i += 8) {
       s1 += in[0]; s2 += s1;
@@ -564,11 +804,93 @@ static unsigned _adler32(unsigned adler32,
     s1 %= ADLER_MOD;
     s2 %= ADLER_MOD;
     in_len -= blk_len;
-    blk_len = 5552;
+    blk_len = SDEFL_ADLER_NMAX;
   }
   return (unsigned)(s2 << 16) + (unsigned)s1;
 }
 
+#ifdef SDEFL_X86
+/*
+ * 32 bytes per step: s1 gets the byte sums (psadbw), s2 gets the byte
+ * sums weighted by 32..1 (pmaddubsw) plus 32 times the running s1
+ */
+__attribute__((target("ssse3")))
+static unsigned _adler32_ssse3(unsigned adler32,
+                               const unsigned char *in,
+                               int in_len)
+{
+  const int BLK = 32;
+  unsigned s1 = adler32 & 0xffff;
+  unsigned s2 = adler32 >> 16;
+  int nblks = in_len / BLK;
+
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                     24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                     8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  in_len -= nblks * BLK;
+  while (nblks) {
+    int n = SDEFL_ADLER_NMAX / BLK;
+    if (n > nblks) n = nblks;
+    nblks -= n;
+
+    __m128i v_ps = _mm_set_epi32(0, 0, 0, s1 * n);
+    __m128i v_s2 = _mm_set_epi32(0, 0, 0, s2);
+    __m128i v_s1 = _mm_setzero_si128();
+    do {
+      const __m128i b1 = _mm_loadu_si128((const __m128i *)in);
+      const __m128i b2 = _mm_loadu_si128((const __m128i *)(in + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b1, zero));
+      v_s2 = _mm_add_epi32(v_s2,
+                           _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b2, zero));
+      v_s2 = _mm_add_epi32(v_s2,
+                           _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+      in += BLK;
+    } while (--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    /* horizontal sums */
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2,3,0,1)));
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1,0,3,2)));
+    s1 += (unsigned)_mm_cvtsi128_si32(v_s1);
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2,3,0,1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1,0,3,2)));
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+
+    s1 %= SDEFL_ADLER_MOD;
+    s2 %= SDEFL_ADLER_MOD;
+  }
+
+  /* the tail */
+  return _adler32_ref((s2 << 16) | s1, in, in_len);
+}
+#endif
+
+static unsigned (*_adler32)(unsigned adler32,
+                            const unsigned char *in,
+                            int in_len) = _adler32_ref;
+
+/* pick the widest implementations the cpu supports, once at startup */
+__attribute__((constructor))
+static void _cpu_dispatch(void)
+{
+#ifdef SDEFL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    _match_len = _match_len_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    _match_len = _match_len_sse2;
+
+  if (__builtin_cpu_supports("ssse3"))
+    _adler32 = _adler32_ssse3;
+#endif
+}
+
 int zdeflate(struct sdefl *s,
              void *out,
              const void *in,
@@ -593,6 +915,13 @@ int zdeflate(struct sdefl *s,
   return (int)(q - (unsigned char *)out);
 }
 
+unsigned deflate_adler32(unsigned adler32,
+                         const void *in,
+                         const int n)
+{
+  return _adler32(adler32, (const unsigned char *)in, n);
+}
+
 int deflate_bound(const int len)
 {
   int a = 128 + (len * 110) / 100;
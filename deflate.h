@@ -33,6 +33,12 @@
 #define SDEFL_LVL_DEF   5
 #define SDEFL_LVL_MAX   8
 
+/* parallel compression: inputs below SDEFL_MT_MIN are not worth the threads */
+#define SDEFL_MT_MIN    (4*SDEFL_BLK_MAX)
+#define SDEFL_MT_MAX    64
+/* helper threads of all the deflate_mt() calls at once, the rest go serial */
+#define SDEFL_MT_SPARE  16
+
 struct sdefl_freq {
   unsigned lit[SDEFL_SYM_MAX];
   unsigned off[SDEFL_OFF_MAX];
@@ -74,6 +80,24 @@ int deflate(struct sdefl *s,
             int n,
             const int lvl);
 
+/*
+ * compress the input in SDEFL_BLK_MAX chunks on up to nthreads threads,
+ * the output is a single raw deflate stream (deflate_bound() still holds),
+ * returns -1 if out of memory, the caller falls back to deflate()
+ */
+int deflate_mt(void *out,
+               const void *in,
+               const int n,
+               const int lvl,
+               int nthreads);
+
+int deflate_chunk(struct sdefl *s,
+                  void *out,
+                  const void *in,
+                  const int n,
+                  const int lvl,
+                  const int is_last);
+
 int zdeflate(struct sdefl *s,
              void *out,
              const void *in,
@@ -82,5 +106,10 @@ int zdeflate(struct sdefl *s,
 
 int deflate_bound(const int in_len);
 
+/* adler32 checksum of the zlib format, start with adler32 = 1 */
+unsigned deflate_adler32(unsigned adler32,
+                         const void *in,
+                         const int n);
+
 
 #endif
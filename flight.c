@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "flight.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+static unsigned _hash(const char *key)
+{
+  /* FNV-1a */
+  unsigned h = 2166136261u;
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619u;
+  }
+  return h % FLIGHT_BUCKETS;
+}
+
+/* drop a reference, under the lock */
+static void _unref(flight_t *f)
+{
+  if (--f->refs) return;
+  pthread_cond_destroy(&f->cond);
+  free(f->key);
+  free(f);
+}
+
+flights_t *flights_new()
+{
+  flights_t *fl = calloc(1, sizeof(struct _flights));
+  pthread_mutex_init(&fl->lock, NULL);
+  return fl;
+}
+
+void flights_destroy(flights_t *fl)
+{
+  pthread_mutex_destroy(&fl->lock);
+  free(fl);
+}
+
+/*
+ * the flight of key with a reference for the caller, a new one if none
+ * is in the air; then *leader is set and the caller must land it
+ */
+flight_t *flight_take(flights_t *fl,
+                      const char *key,
+                      int *leader)
+{
+  unsigned h = _hash(key);
+
+  pthread_mutex_lock(&fl->lock);
+  flight_t *f = fl->buckets[h];
+  while (f && strcmp(f->key, key) != 0) f = f->next;
+
+  if (f) {
+    f->refs++;
+    fl->njoined++;
+    *leader = 0;
+  }
+  else {
+    f = calloc(1, sizeof(struct _flight));
+    f->key = strdup(key);
+    f->refs = 1;
+    pthread_cond_init(&f->cond, NULL);
+    f->next = fl->buckets[h];
+    fl->buckets[h] = f;
+    fl->nled++;
+    *leader = 1;
+  }
+  pthread_mutex_unlock(&fl->lock);
+
+  D_PRINT("[FLIGHT] %s %s\n", *leader ? "leading" : "joined", key);
+  return f;
+}
+
+/* block until the leader lands, the reference is dropped */
+void flight_wait(flights_t *fl,
+                 flight_t *f)
+{
+  pthread_mutex_lock(&fl->lock);
+  while (!f->landed) pthread_cond_wait(&f->cond, &fl->lock);
+  _unref(f);
+  pthread_mutex_unlock(&fl->lock);
+}
+
+/*
+ * leave waiter for the leader instead of blocking, the reference is
+ * dropped; returns 0 if the flight has landed or is full, then the
+ * caller does the work itself
+ */
+int flight_park(flights_t *fl,
+                flight_t *f,
+                void *waiter)
+{
+  int parked = 0;
+
+  pthread_mutex_lock(&fl->lock);
+  if (!f->landed && f->nparked < FLIGHT_PARK_MAX) {
+    f->parked[f->nparked++] = waiter;
+    parked = 1;
+  }
+  _unref(f);
+  pthread_mutex_unlock(&fl->lock);
+
+  return parked;
+}
+
+/* no one joins f any more, under the lock */
+static void _unlink(flights_t *fl,
+                    flight_t *f)
+{
+  if (f->landed) return;
+  flight_t **p = &fl->buckets[_hash(f->key)];
+  while (*p != f) p = &(*p)->next;
+  *p = f->next;
+  f->landed = 1;
+}
+
+/*
+ * the leader is done, or far enough for the followers to take over:
+ * later requests start a new flight, the blocked followers wake up and
+ * the parked ones are copied to parked (if not NULL), returns their count
+ */
+int flight_land(flights_t *fl,
+                flight_t *f,
+                void **parked)
+{
+  pthread_mutex_lock(&fl->lock);
+  _unlink(fl, f);
+  int n = f->nparked;
+  if (parked && n) memcpy(parked, f->parked, n * sizeof(void *));
+  pthread_cond_broadcast(&f->cond);
+  _unref(f);
+  pthread_mutex_unlock(&fl->lock);
+
+  return n;
+}
+
+/* one more reference for the leader, to look at f after it has landed */
+void flight_hold(flights_t *fl,
+                 flight_t *f)
+{
+  pthread_mutex_lock(&fl->lock);
+  f->refs++;
+  pthread_mutex_unlock(&fl->lock);
+}
+
+/* the reference of *held is dropped and *held cleared */
+void flight_release(flights_t *fl,
+                    flight_t **held)
+{
+  pthread_mutex_lock(&fl->lock);
+  flight_t *f = *held;
+  *held = NULL;
+  if (f) _unref(f);
+  pthread_mutex_unlock(&fl->lock);
+}
+
+/*
+ * 1 if no follower has parked on *held, landed or not, nor can from now
+ * on: the work is for the leader alone and may be dropped; *held is read
+ * under the lock as the leader may release it meanwhile
+ */
+int flight_alone(flights_t *fl,
+                 flight_t **held)
+{
+  pthread_mutex_lock(&fl->lock);
+  flight_t *f = *held;
+  int alone = !f || !f->nparked;
+  if (f && alone) _unlink(fl, f);
+  pthread_mutex_unlock(&fl->lock);
+
+  return alone;
+}
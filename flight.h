@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#ifndef _FLIGHT_H_
+#define _FLIGHT_H_
+
+
+#define FLIGHT_BUCKETS 64
+#define FLIGHT_PARK_MAX 64  /* async followers of a flight */
+
+
+/*
+ * single flight: the first request of a key does the work, the identical
+ * ones which come meanwhile take its result instead of repeating it
+ */
+typedef struct _flight flight_t;
+
+struct _flight {
+  char *key;
+  int refs;       /* the leader and the blocked followers */
+  int landed;
+  pthread_cond_t cond;
+  void *parked[FLIGHT_PARK_MAX];  /* followers which can't block */
+  int nparked;
+  struct _flight *next;
+};
+
+typedef struct _flights flights_t;
+
+struct _flights {
+  flight_t *buckets[FLIGHT_BUCKETS];
+  pthread_mutex_t lock;
+
+  /* metrics */
+  volatile long nled;     /* flights, the work done */
+  volatile long njoined;  /* followers, the work saved */
+};
+
+
+flights_t *flights_new();
+
+void flights_destroy(flights_t *fl);
+
+flight_t *flight_take(flights_t *fl,
+                      const char *key,
+                      int *leader);
+
+void flight_wait(flights_t *fl,
+                 flight_t *f);
+
+int flight_park(flights_t *fl,
+                flight_t *f,
+                void *waiter);
+
+int flight_land(flights_t *fl,
+                flight_t *f,
+                void **parked);
+
+void flight_hold(flights_t *fl,
+                 flight_t *f);
+
+void flight_release(flights_t *fl,
+                    flight_t **held);
+
+int flight_alone(flights_t *fl,
+                 flight_t **held);
+
+
+#endif
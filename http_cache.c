@@ -4,8 +4,12 @@
  * license: MIT license
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include "util.h"
+#include "inflate.h"
 #include "linkedlist.h"
 #include "http_cache.h"
 
@@ -13,9 +17,11 @@
 #include "debug.h"
 
 
+/* with a reference for the caller */
 cache_data_t *http_cache_data_new()
 {
   cache_data_t *data = malloc(sizeof(struct _cache_data));
+  data->refs = 1;
   return data;
 }
 
@@ -35,6 +41,7 @@ void http_set_cache_data(cache_data_t *data,
   data->len_body = len_body;
   data->body_zipped = body_zipped;
   data->len_zipped = len_zipped;
+  data->last_access = mstime();
 }
 
 void http_cache_data_destroy(cache_data_t *data)
@@ -49,20 +56,126 @@ void http_cache_data_destroy(cache_data_t *data)
   }
 }
 
+/*
+ * a cached file with a reference for the caller, NULL on a miss; the
+ * list is shared by the workers, they only read it
+ */
 cache_data_t *http_cache_data(list_t *cache,
                               const char *path)
 {
+  cache_data_t *data = NULL;
+  node_t *node;
+
+  pthread_rwlock_rdlock(&cache->lock);
+  for (node = cache->head; node; node = node->next) {
+    if (strcmp(path, ((cache_data_t *)node->data)->path) == 0) {
+      data = node->data;
+      data->last_access = mstime();
+      __sync_fetch_and_add(&data->refs, 1);
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&cache->lock);
+
+  return data;
+}
+
+/* the last one out, the cache or a reply, frees the entry */
+void http_cache_release(cache_data_t *data)
+{
+  if (__sync_sub_and_fetch(&data->refs, 1) == 0)
+    http_cache_data_destroy(data);
+}
+
+/* the cache takes a reference of its own */
+void http_cache_add(list_t *cache,
+                    cache_data_t *data)
+{
+  __sync_fetch_and_add(&data->refs, 1);
+  pthread_rwlock_wrlock(&cache->lock);
+  list_update(cache, data, mstime());
+  pthread_rwlock_unlock(&cache->lock);
+}
+
+/* older entries leave the cache, a reply still sending one keeps it */
+void http_cache_expire(list_t *cache,
+                       const long timeout)
+{
+  long cur_time = mstime();
+
+  pthread_rwlock_wrlock(&cache->lock);
   node_t *node = list_first(cache);
+  while (node) {
+    cache_data_t *data = node->data;
+    long stamp = node->stamp;
+    node = list_next(cache);
 
-  if (node) {
-    do {
-      cache_data_t *data = node->data;
-      if (strcmp(path, data->path) == 0) {
-        return data;
-      }
-      node = list_next(cache);
-    } while (node);
+    if (cur_time - stamp >= timeout) {
+      list_remove(cache, data);
+      http_cache_release(data);
+      D_PRINT("[CACHE] cached data expired!\n");
+    }
   }
+  pthread_rwlock_unlock(&cache->lock);
+}
+
+/*
+ * cold text entries keep only the compressed bytes; no reply can take
+ * an entry meanwhile, so the cache holding the only reference means no
+ * one reads the raw body
+ */
+void http_cache_cool(list_t *cache,
+                     const long timeout)
+{
+  long cur_time = mstime();
+  node_t *node;
+
+  pthread_rwlock_wrlock(&cache->lock);
+  for (node = cache->head; node; node = node->next) {
+    cache_data_t *data = node->data;
+    if (cur_time - data->last_access >= timeout && data->refs == 1)
+      http_cache_demote(data);
+  }
+  pthread_rwlock_unlock(&cache->lock);
+}
+
+/*
+ * the raw body of an entry, a compressed-only (cold) entry is inflated
+ * again and becomes warm, NULL if it can't be restored
+ */
+unsigned char *http_cache_body(cache_data_t *data)
+{
+  unsigned char *body = data->body;
+  if (body || !data->body_zipped) return body;
+
+  body = malloc(data->len_body);
+  int n = inflate(body, data->len_body, data->body_zipped, data->len_zipped);
+  if (n != (int)data->len_body) {
+    D_PRINT("[CACHE] couldn't restore %s\n", data->path);
+    free(body);
+    return NULL;
+  }
+  D_PRINT("[CACHE] %s inflated\n", data->path);
+
+  /* another thread may have restored it in the meantime */
+  if (!__sync_bool_compare_and_swap(&data->body, NULL, body)) {
+    free(body);
+    body = data->body;
+  }
+  return body;
+}
+
+/*
+ * drop the raw body of an entry which also has the compressed one,
+ * returns the bytes released
+ */
+int http_cache_demote(cache_data_t *data)
+{
+  unsigned char *body = data->body;
+  if (!body || !data->body_zipped || !data->etag) return 0;
 
-  return NULL;
+  if (!__sync_bool_compare_and_swap(&data->body, body, NULL)) return 0;
+  free(body);
+  D_PRINT("[CACHE] %s kept compressed only\n", data->path);
+  return data->len_body;
 }
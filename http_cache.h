@@ -18,6 +18,8 @@ struct _cache_data {
   unsigned char *body_zipped;
   size_t len_body;
   size_t len_zipped;
+  long last_access;  /* ms, a cold entry may drop the raw body */
+  volatile int refs; /* the cache holds one, every reply in progress too */
 };
 
 
@@ -37,5 +39,20 @@ void http_cache_data_destroy(cache_data_t *data);
 cache_data_t *http_cache_data(list_t *cache,
                               const char *path);
 
+void http_cache_release(cache_data_t *data);
+
+void http_cache_add(list_t *cache,
+                    cache_data_t *data);
+
+void http_cache_expire(list_t *cache,
+                       const long timeout);
+
+void http_cache_cool(list_t *cache,
+                     const long timeout);
+
+unsigned char *http_cache_body(cache_data_t *data);
+
+int http_cache_demote(cache_data_t *data);
+
 
 #endif
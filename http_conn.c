@@ -9,17 +9,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <libpq-fe.h>
 #include "util.h"
 #include "io.h"
+#include "arena.h"
+#include "slab.h"
+#include "thpool.h"
 #include "linkedlist.h"
+#include "pg_conn.h"
+#include "flight.h"
 #include "http_msg.h"
 #include "http_parser.h"
 #include "http_get.h"
-#include "http_post.h"
 #include "http_conn.h"
+#include "http_post.h"
 
 //#define DEBUG
 #include "debug.h"
@@ -27,16 +33,43 @@
 
 httpconn_t *httpconn_new(const int sockfd,
                          const int epfd,
-                         PGconn *pgconn,
+                         struct _backend *backend,
+                         struct _sqlcache *sqlcache,
+                         struct _sqlwriter *writer,
+                         struct _snapshot *snapshot,
+                         struct _flights *flights,
                          list_t *cache,
-                         list_t *timers)
+                         list_t *timers,
+                         slab_t *pool)
 {
-  httpconn_t *conn = malloc(sizeof(struct _httpconn));
+  httpconn_t *conn = slab_alloc(pool);
+  if (!conn) return NULL;
+  conn->pool = pool;
   conn->sockfd = sockfd;
   conn->epfd = epfd;
-  conn->pgconn = pgconn;
+  conn->backend = backend;
+  conn->sqlcache = sqlcache;
+  conn->writer = writer;
+  conn->snapshot = snapshot;
+  conn->flights = flights;
   conn->cache = cache;
   conn->timers = timers;
+  conn->arena = arena_new(CONN_ARENA_SIZE);
+  if (!conn->arena) {
+    slab_free(pool, conn);
+    return NULL;
+  }
+  conn->sqlreq = NULL;
+  conn->deadline = 0;
+  conn->cancel = NULL;
+  conn->flight = NULL;
+  conn->state = CONN_IDLE;
+  conn->refs = 0;
+  conn->last_active = mstime();
+  conn->req = NULL;
+  conn->len_left = 0;
+  conn->batch = NULL;
+  conn->writes = 0;
 
   return conn;
 }
@@ -44,53 +77,138 @@ httpconn_t *httpconn_new(const int sockfd,
 void httpconn_destroy(httpconn_t *conn)
 {
   D_PRINT("[CONN] socket %d closed from server\n", conn->sockfd);
+  http_post_drop(conn);
   shutdown(conn->sockfd, SHUT_RDWR);
   close(conn->sockfd);
-  free(conn);
+  arena_destroy(conn->arena);
+  slab_free(conn->pool, conn);
 }
 
-void httpconn_task(void *arg)
+/*
+ * on the event loop, before a task is queued for an event of the client
+ * or of its query; returns 0 if the connection is closing
+ */
+int httpconn_take(httpconn_t *conn)
 {
-  httpconn_t *conn = (struct _httpconn *)arg;
-  int rc;
-  unsigned char *bytes = io_socket_read(conn->sockfd, &rc);
+  if (conn->state == CONN_CLOSING) return 0;
+  __sync_fetch_and_add(&conn->refs, 1);
+  __sync_bool_compare_and_swap(&conn->state, CONN_IDLE, CONN_ACTIVE);
+  return 1;
+}
+
+void httpconn_rearm(httpconn_t *conn)
+{
+  /* idle, it may be closed now, but not before the event is back */
+  __sync_fetch_and_add(&conn->refs, 1);
+  conn->last_active = mstime();
+  if (__sync_bool_compare_and_swap(&conn->state, CONN_ACTIVE, CONN_IDLE)) {
+    /* put the event back */
+    struct epoll_event event;
+    event.data.ptr = (void *)conn;
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    int rc = epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->sockfd, &event);
+    if (rc == -1) perror("epoll_ctl()...");
+  }
+  __sync_fetch_and_sub(&conn->refs, 1);
+}
+
+/* the client has gone, the event loop frees the connection */
+void httpconn_close(httpconn_t *conn)
+{
+  __sync_bool_compare_and_swap(&conn->state, CONN_ACTIVE, CONN_CLOSING);
+}
+
+/*
+ * on the event loop: an idle connection past timeout is closed, returns
+ * 1 once a closed one is held by no one, writes of its array included,
+ * and can be destroyed
+ */
+int httpconn_expired(httpconn_t *conn,
+                     const long now,
+                     const long timeout)
+{
+  /* the writer still calls back on it */
+  if (conn->writes) return 0;
+  if (conn->state == CONN_IDLE && now - conn->last_active >= timeout)
+    __sync_bool_compare_and_swap(&conn->state, CONN_IDLE, CONN_CLOSING);
+  return conn->state == CONN_CLOSING && conn->refs == 0;
+}
+
+static void _task(httpconn_t *conn)
+{
+  int rc, len;
+
+  /* the database answered, the client socket stays disarmed until done */
+  if (conn->sqlreq) {
+    if (http_post_resume(conn)) httpconn_rearm(conn);
+    return;
+  }
+
+  unsigned char *bytes = io_socket_read(conn->sockfd, &len, &rc);
 
   /* rc = 0:  the client has closed the connection */
   if (rc == 0) {
     D_PRINT("[CONN] client disconnected: %d\n", conn->sockfd);
+    httpconn_close(conn);
     return;
   }
 
-  /* rc = -1: EAGAIN (Resource busy) */
+  /* rc = -1: EAGAIN (Resource busy), nothing to read after all */
   if (rc == -1) {
     D_PRINT("[CONN] sock error: %d\n", conn->sockfd);
+    if (errno == EAGAIN || errno == EWOULDBLOCK) httpconn_rearm(conn);
+    else httpconn_close(conn);
+    return;
+  }
+
+  /* more of the body of a POST */
+  if (rc == 1 && conn->req) {
+    if (!http_post_more(conn, bytes, len)) httpconn_rearm(conn);
+    free(bytes);
     return;
   }
 
   if (rc == 1) {
     D_PRINT("[CONN] raw bytes: %s\n", bytes);
-    httpmsg_t *req = http_parse_req(bytes);
 
-    if (!req) return;
+    /* the last reply is out, nothing of it is read any more */
+    arena_reset(conn->arena);
+    httpmsg_t *req = http_parse_req(conn->arena, bytes, len);
+
+    /* no answer to a broken request, the connection is dropped */
+    if (!req) {
+      free(bytes);
+      httpconn_close(conn);
+      return;
+    }
+
+    int pending = 0;
 
-    /* static GET */
-    if (req->method == METHOD_GET || req->method == METHOD_HEAD) {
-      http_get(conn->sockfd, conn->cache, req->path, req);
+    /* table exports, then static GET */
+    if (req->method == METHOD_GET && http_is_export(req->path)) {
+      pending = http_export(conn, req->path, req);
+    }
+    else if (req->method == METHOD_GET || req->method == METHOD_HEAD) {
+      http_get(conn->sockfd, conn->cache, conn->flights, req->path, req);
     }
 
+    /* the request goes with the post, its body may not be all here */
     if (req->method == METHOD_POST) {
-      http_post(conn->sockfd, conn->pgconn, req->path, req);
+      pending = http_post(conn, req->path, req);
     }
 
-    msg_destroy(req, 1);
     free(bytes);
 
-    /* put the event back */
-    struct epoll_event event;
-    event.data.ptr = (void *)conn;
-    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-    rc = epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->sockfd, &event);
-    if (rc == -1) perror("epoll_ctl()...");
+    /* a query in flight puts the event back when it completes */
+    if (!pending) httpconn_rearm(conn);
     return;
   }
 }
+
+/* a worker holds the connection while it runs */
+void httpconn_task(void *arg)
+{
+  httpconn_t *conn = (struct _httpconn *)arg;
+  _task(conn);
+  __sync_fetch_and_sub(&conn->refs, 1);
+}
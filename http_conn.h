@@ -8,25 +8,72 @@
 #define _HTTPCONN_H_
 
 
+#define CONN_ARENA_SIZE 8192  /* bytes, kept from one request to the next */
+
+#define CONN_IDLE 0     /* armed, waits for the client */
+#define CONN_ACTIVE 1   /* a task runs, or its reply is pending */
+#define CONN_CLOSING 2  /* closed by the event loop once no one holds it */
+
+
 typedef struct _httpconn httpconn_t;
 
 struct _httpconn {
+  struct _slab *pool;      /* where the connection comes from */
   int sockfd;
   int epfd;
-  PGconn *pgconn;
+  struct _backend *backend;    /* where the SELECTs go */
+  struct _sqlcache *sqlcache;  /* results of the single SELECTs */
+  struct _sqlwriter *writer;   /* group commits the writes */
+  struct _snapshot *snapshot;  /* tables answered from memory */
+  struct _flights *flights;    /* identical requests in progress */
   list_t *cache;
   list_t *timers;
+  struct _arena *arena;    /* the request and its reply, reset per request */
+  struct _sqlreq *sqlreq;  /* query in flight, resumed on the db socket */
+  long deadline;           /* ms, when the query in flight is cancelled */
+  struct pg_cancel *volatile cancel;  /* of the query, taken by one side */
+  struct _flight *flight;  /* the query leads it, held until it is done */
+
+  /*
+   * only the event loop frees a connection: an idle one may be closed,
+   * an active one is the workers' until it is rearmed; the references
+   * are the tasks, and a rearm until its event is back in epoll
+   */
+  volatile int state;
+  volatile int refs;
+  volatile long last_active;  /* ms, when it was rearmed */
+  volatile int writes;        /* of its array, still at the writer */
+
+  /* a POST whose body is still coming in */
+  struct _httpmsg *req;
+  long len_left;              /* bytes of the body not read yet */
+  struct _postbatch *batch;   /* a json array, run as its objects close */
 };
 
 
 httpconn_t *httpconn_new(const int sockfd,
                          const int epfd,
-                         PGconn *pgconn,
+                         struct _backend *backend,
+                         struct _sqlcache *sqlcache,
+                         struct _sqlwriter *writer,
+                         struct _snapshot *snapshot,
+                         struct _flights *flights,
                          list_t *cache,
-                         list_t *timers);
+                         list_t *timers,
+                         struct _slab *pool);
 
 void httpconn_destroy(httpconn_t *conn);
 
+int httpconn_take(httpconn_t *conn);
+
+void httpconn_rearm(httpconn_t *conn);
+
+void httpconn_close(httpconn_t *conn);
+
+int httpconn_expired(httpconn_t *conn,
+                     const long now,
+                     const long timeout);
+
 void httpconn_task(void *arg);
 
 
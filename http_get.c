@@ -10,12 +10,17 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include "util.h"
 #include "linkedlist.h"
 #include "io.h"
 #include "deflate.h"
 #include "mime.h"
+#include "zpolicy.h"
+#include "flight.h"
+#include "arena.h"
 #include "http_msg.h"
 #include "http_cache.h"
 #include "http_get.h"
@@ -40,11 +45,14 @@ static size_t _process_range(httpmsg_t *rep,
   char *range_s = split_kv(range_str, '=');
   char *range_e = split_kv(range_s, '-');
 
-  range_si = atoi(range_s);
+  /* a range past the end is cut at the end of the body */
+  range_si = atol(range_s);
+  if (range_si > len_body) range_si = len_body;
   /* req: bytes=xxxx-xxxx */
   if (*range_e) {
     range_ei = atol(range_e);
-    *len_range = range_ei - range_si + 1;
+    if (range_ei >= len_body) range_ei = len_body - 1;
+    *len_range = range_ei + 1 > range_si ? range_ei - range_si + 1 : 0;
     sprintf(range, "bytes %lu-%lu/%lu", range_si, range_ei, len_body);
   }
   /* req: bytes=xxxx- */
@@ -60,7 +68,6 @@ static size_t _process_range(httpmsg_t *rep,
 }
 
 static httpmsg_t *_get_rep(const char *ctype,
-                           const int mtype,
                            cache_data_t *cdata,
                            const httpmsg_t *req)
 {
@@ -68,12 +75,12 @@ static httpmsg_t *_get_rep(const char *ctype,
   char len_str[16];
   char *zip_enc = msg_header_value(req, "Accept-Encoding");
 
-  httpmsg_t* rep = msg_new();
+  httpmsg_t* rep = msg_new(req->arena);
 
   if (!cdata->etag) {  /* 404 code */
     msg_set_rep_line(rep, 1, 1, 404, "Not Found");
     /* compressed */
-    if (mtype == MIME_TXT && zip_enc && strstr(zip_enc, "deflate")) {
+    if (cdata->body_zipped && zip_enc && strstr(zip_enc, "deflate")) {
       msg_add_header(rep, "Content-Encoding", "deflate");
       msg_add_zipped_body(rep, cdata->body_zipped, cdata->len_zipped);
       msg_set_body_start(rep, cdata->body_zipped);
@@ -110,7 +117,7 @@ static httpmsg_t *_get_rep(const char *ctype,
     msg_add_header(rep, "Content-Type", ctype);
 
     /* compressed */
-    if (mtype == MIME_TXT && zip_enc && strstr(zip_enc, "deflate")) {
+    if (cdata->body_zipped && zip_enc && strstr(zip_enc, "deflate")) {
       msg_add_header(rep, "Content-Encoding", "deflate");
       msg_add_header(rep, "Vary", "Accept-Encoding");
       msg_add_zipped_body(rep, cdata->body_zipped, cdata->len_zipped);
@@ -126,17 +133,26 @@ static httpmsg_t *_get_rep(const char *ctype,
         range_s = _process_range(rep, range_str, &len_range, cdata->len_zipped);
         D_PRINT("[GREP] range start: %ld, length: %ld\n", range_s, len_range);
         msg_set_body_start(rep, cdata->body_zipped + range_s);
+        rep->len_body = len_range;  /* what is sent from the start */
         itos((unsigned char *)len_str, len_range, 10, ' ');
         msg_add_header(rep, "Content-Length", len_str);
       }
     }
-    /* uncompressed */
+    /* uncompressed, a cold entry is inflated first */
     else {
-      msg_add_body(rep, cdata->body, cdata->len_body);
+      unsigned char *body = http_cache_body(cdata);
+      if (!body) {
+        msg_set_rep_line(rep, 1, 1, 500, "Internal Server Error");
+        msg_add_body(rep, NULL, 0);
+        msg_set_body_start(rep, NULL);
+        msg_add_header(rep, "Content-Length", "0");
+        return rep;
+      }
+      msg_add_body(rep, body, cdata->len_body);
 
       if (!range_str) {
         msg_set_rep_line(rep, 1, 1, 200, "OK");
-        msg_set_body_start(rep, cdata->body);
+        msg_set_body_start(rep, body);
         itos((unsigned char *)len_str, cdata->len_body, 10, ' ');
         msg_add_header(rep, "Content-Length", len_str);
       }
@@ -144,7 +160,8 @@ static httpmsg_t *_get_rep(const char *ctype,
         msg_set_rep_line(rep, 1, 1, 206, "Partial Content");
         range_s = _process_range(rep, range_str, &len_range, cdata->len_body);
         D_PRINT("[GREP] range start: %ld, length: %ld\n", range_s, len_range);
-        msg_set_body_start(rep, cdata->body + range_s);
+        msg_set_body_start(rep, body + range_s);
+        rep->len_body = len_range;  /* what is sent from the start */
         itos((unsigned char *)len_str, len_range, 10, ' ');
         msg_add_header(rep, "Content-Length", len_str);
       }
@@ -153,9 +170,12 @@ static httpmsg_t *_get_rep(const char *ctype,
   return rep;
 }
 
+/* the reply points into the entry, which is held until it is sent */
 httpmsg_t *_get_rep_msg(list_t *cache,
+                        flights_t *flights,
                         const char *path,
-                        const httpmsg_t *req)
+                        const httpmsg_t *req,
+                        cache_data_t **held)
 {
   /* get the fullpath and extention of a file */
   char curdir[MAX_CWD];
@@ -180,12 +200,27 @@ httpmsg_t *_get_rep_msg(list_t *cache,
   cache_data_t *data = http_cache_data(cache, path);
 
   if (data) {
-    rep = _get_rep(content_type, mime_type, data, req);
+    *held = data;
+    rep = _get_rep(content_type, data, req);
     D_PRINT("[CACHE] In the cache!\n");
     return rep;
   }
 
-  /* not in the cache ... */
+  /* not in the cache, the first miss loads it and the others look again */
+  int leader;
+  flight_t *flight = flight_take(flights, path, &leader);
+  if (!leader) {
+    flight_wait(flights, flight);
+    flight = NULL;
+    data = http_cache_data(cache, path);
+    if (data) {
+      *held = data;
+      rep = _get_rep(content_type, data, req);
+      D_PRINT("[CACHE] Loaded by another request!\n");
+      return rep;
+    }
+  }
+
   struct stat sb;
   char *last_modified;
   char *etag;
@@ -214,15 +249,28 @@ httpmsg_t *_get_rep_msg(list_t *cache,
     body = io_fread(ospath, len_body);
   }
 
-  if (mime_type == MIME_TXT) {
+  int zlvl = zpolicy_level(content_type, mime_type, len_body);
+  if (zlvl != ZP_NONE) {
     struct sdefl c;   /* compressor */
     /* compress the body */
     len_zipbuf = deflate_bound(len_body);
     body_zipped = malloc(len_zipbuf);
     /* compressed body start should sync with body start */
-    len_zipped = deflate(&c, body_zipped, body, len_body, 5);
-
-    D_PRINT("[MEM] len_zipped: %ld\n", len_zipped);
+    int rc = -1;
+    if (len_body >= SDEFL_MT_MIN)
+      /* large file, compress the chunks on all the cores */
+      rc = deflate_mt(body_zipped, body, len_body, zlvl, get_nprocs());
+    if (rc < 0)
+      rc = deflate(&c, body_zipped, body, len_body, zlvl);
+    len_zipped = rc;
+
+    D_PRINT("[MEM] level %d, len_zipped: %ld\n", zlvl, len_zipped);
+    /* no gain, don't keep it */
+    if (len_zipped >= len_body) {
+      free(body_zipped);
+      body_zipped = NULL;
+      len_zipped = 0;
+    }
     http_set_cache_data(data, strdup(path), etag, last_modified,
                         body, len_body, body_zipped, len_zipped);
   }
@@ -230,8 +278,10 @@ httpmsg_t *_get_rep_msg(list_t *cache,
     http_set_cache_data(data, strdup(path), etag, last_modified,
                         body, len_body, NULL, 0);
 
-  list_update(cache, data, mstime());
-  rep = _get_rep(content_type, mime_type, data, req);
+  http_cache_add(cache, data);
+  if (flight) flight_land(flights, flight, NULL);
+  *held = data;
+  rep = _get_rep(content_type, data, req);
   D_PRINT("[CACHE] Cached in...\n");
 
   return rep;
@@ -239,13 +289,16 @@ httpmsg_t *_get_rep_msg(list_t *cache,
 
 void http_get(const int clifd,
               list_t *cache,
+              flights_t *flights,
               const char *path,
               const httpmsg_t *req)
 {
-  httpmsg_t *rep = _get_rep_msg(cache, path, req);
+  cache_data_t *data;
+  httpmsg_t *rep = _get_rep_msg(cache, flights, path, req, &data);
 
+  /* the reply is built in the arena of the request */
   int len_headers = msg_headers_len(rep);
-  char *headers = malloc(len_headers);
+  char *headers = arena_alloc(rep->arena, len_headers);
   msg_rep_headers(headers, rep);
 
   /* send msg */
@@ -258,7 +311,5 @@ void http_get(const int clifd,
     D_PRINT("[GREP] Sending reply body... %d\n", clifd);
     io_socket_write(clifd, rep->body_s, rep->len_body);
   }
-
-  free(headers);
-  msg_destroy(rep, 0);
+  http_cache_release(data);
 }
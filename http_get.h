@@ -11,6 +11,7 @@
 /* GET */
 void http_get(const int clifd,
               list_t *cache,
+              flights_t *flights,
               const char *path,
               const httpmsg_t *req);
 
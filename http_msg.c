@@ -9,6 +9,7 @@
 #include <string.h>
 #include "memcpy_sse2.h"
 #include "util.h"
+#include "arena.h"
 #include "http_msg.h"
 
 //#define DEBUG
@@ -20,11 +21,13 @@
 #define CR '\r'
 
 
-httpmsg_t *msg_new()
+/* the message, its lines and strings live in the arena, they go with it */
+httpmsg_t *msg_new(arena_t *arena)
 {
-  httpmsg_t *msg = malloc(sizeof(struct _httpmsg));
+  httpmsg_t *msg = arena_alloc(arena, sizeof(struct _httpmsg));
+  msg->arena = arena;
   msg->headers = (struct _httphdr *)
-                 malloc(sizeof(struct _httphdr) * MAX_NUM_HEADERS);
+                 arena_alloc(arena, sizeof(struct _httphdr) * MAX_NUM_HEADERS);
   msg->len_startline = 0;
   msg->len_headers = 0;
   msg->num_headers = 0;
@@ -34,6 +37,7 @@ httpmsg_t *msg_new()
   msg->status = NULL;
 
   msg->body = NULL;
+  msg->len_body = 0;
   msg->body_zipped = NULL;
   return msg;
 }
@@ -61,39 +65,30 @@ void msg_add_zipped_body(httpmsg_t *msg,
   msg->len_body = len;
 }
 
+/* only a body from malloc is freed, the rest goes with the arena */
 void msg_destroy(httpmsg_t *msg,
                  const int delbody)
 {
-  if (!msg) return;
+  if (!msg || !delbody) return;
 
-  int i = 0;
-
-  if (msg->path) free(msg->path);
-  if (msg->status) free(msg->status);
-
-  do {
-    if (msg->headers[i].key) free(msg->headers[i].key);
-    if (msg->headers[i].value) free(msg->headers[i].value);
-    i++;
-  } while (i < msg->num_headers);
-
-  if (delbody) {
-    if (msg->body) free(msg->body);
-    if (msg->body_zipped) free(msg->body_zipped);
-  }
-  free(msg->headers);
-  free(msg);
+  if (msg->body) free(msg->body);
+  if (msg->body_zipped) free(msg->body_zipped);
+  msg->body = NULL;
+  msg->body_zipped = NULL;
 }
 
-int msg_split(unsigned char *lines[],
+int msg_split(arena_t *arena,
+              unsigned char *lines[],
               int *nlines,
               int *len_body,
-              const unsigned char *buf)
+              const unsigned char *buf,
+              const int len)
 {
+  const unsigned char* end = buf + len;
   const unsigned char* p = buf;
   const unsigned char* h = p;
   int i;
-  int len;
+  int n;
   int size;
 
   if (*p == CR || *p == LF) {
@@ -101,7 +96,6 @@ int msg_split(unsigned char *lines[],
   }
 
   i = 0;
-  len = 0;
   do {
     if (*p == LF) {
       /*
@@ -116,45 +110,34 @@ int msg_split(unsigned char *lines[],
        */
       size = p - h;
       if (!size) return 0;
-      len = size - 1;
-      lines[i] = malloc(size);
-      memcpy_fast(lines[i], h, len);
-      lines[i][len] = '\0';
+      if (i == MAX_NUM_MSG_LINES - 1) return 0;  /* too many headers */
+      n = size - 1;
+      lines[i] = (unsigned char *)arena_strndup(arena, (const char *)h, n);
       h = p + 1;
       i++;
-    }
 
-    /* a http message should at least consist of 3 lines */
-    if (i > 3 && *(p - 1) == CR && *(p - 2) == LF && *(p - 3) == CR) {
-      if (*(p + 1) == CR) return 0;  /* CR without LF followed */
-      *nlines = i - 1;  /* end of headers */
+      /* the empty line ends the headers, there may be none of them */
+      if (!n && i > 1) {
+        if (p + 1 < end && *(p + 1) == CR) return 0;  /* CR without LF */
+        *nlines = i - 1;  /* end of headers */
+        p++;
+        break;
+      }
     }
 
     p++;
-  } while (*p);
+  } while (p < end && *p);
 
-  /* body */
-  *len_body = p - h;
+  /* body, everything after the headers (it may be binary) */
+  *len_body = end - p;
   if (*len_body) {
-    lines[i] = malloc(*len_body);
-    memcpy_fast(lines[i], h, *len_body);
+    lines[i] = arena_alloc(arena, *len_body);
+    memcpy_fast(lines[i], p, *len_body);
   }
 
   return i;
 }
 
-void msg_lines_destroy(unsigned char *lines[],
-                       const int count)
-{
-  int i = 0;
-  do {
-    if (lines[i]) {
-      free(lines[i]);
-      i++;
-    }
-  } while (i < count);
-}
-
 void msg_set_req_line(httpmsg_t *msg,
                       const char *method,
                       const char *path,
@@ -170,7 +153,7 @@ void msg_set_req_line(httpmsg_t *msg,
   total += len;
 
   len = strlen(path);
-  msg->path = strdup(path);
+  msg->path = arena_strndup(msg->arena, path, len);
   total += len;
 
   msg->ver_major = major;
@@ -199,7 +182,7 @@ void msg_set_rep_line(httpmsg_t *msg,
   msg->code = code;
 
   len = strlen(status);
-  msg->status = strdup(status);
+  msg->status = arena_strndup(msg->arena, status, len);
 
   /*
    * HTTP/1.1 200 OK\r\n
@@ -217,16 +200,14 @@ void msg_add_header(httpmsg_t *msg,
 {
   int len_k, len_v, total;
 
+  if (msg->num_headers == MAX_NUM_HEADERS) return;
+
   len_k = strlen(key);
   len_v = strlen(value);
 
-  msg->headers[msg->num_headers].key = malloc(len_k + 1);
-  memcpy_fast(msg->headers[msg->num_headers].key, key, len_k);
-  msg->headers[msg->num_headers].key[len_k] = 0;
-
-  msg->headers[msg->num_headers].value = malloc(len_v + 1);
-  memcpy_fast(msg->headers[msg->num_headers].value, value, len_v);
-  msg->headers[msg->num_headers].value[len_v] = 0;
+  msg->headers[msg->num_headers].key = arena_strndup(msg->arena, key, len_k);
+  msg->headers[msg->num_headers].value = arena_strndup(msg->arena, value,
+                                                       len_v);
 
   total = len_k + len_v;
 
@@ -244,13 +225,12 @@ void msg_add_header(httpmsg_t *msg,
 char *msg_header_value(const httpmsg_t *msg,
                        const char *key)
 {
-  int i = 0;
-  do {
+  int i;
+  for (i = 0; i < msg->num_headers; i++) {
     if(strcmp(msg->headers[i].key, key) == 0) {
       return msg->headers[i].value;
     }
-    i++;
-  } while (i < msg->num_headers);
+  }
 
   return NULL;
 }
@@ -264,9 +244,8 @@ int msg_add_headers(httpmsg_t *msg,
   int i;
 
   /* headers ... */
-  if (lines[nlines][0] == 0) {  /* empty line */
-    i = 1;
-    do {
+  if (nlines && lines[nlines][0] == 0) {  /* empty line */
+    for (i = 1; i < nlines; i++) {
       if (lines[i][0] == 0) {  /* wrong empty line */
         D_PRINT("Not valid message!!!\n");
         return 0;
@@ -274,8 +253,7 @@ int msg_add_headers(httpmsg_t *msg,
       key = (char *)lines[i];
       value = split_kv((char *)lines[i], ':');
       msg_add_header(msg, key, value);
-      i++;
-    } while (i < nlines);
+    }
   }
   else {
     D_PRINT("Incomplete message!!!\n");
@@ -303,7 +281,7 @@ int msg_headers_len(const httpmsg_t *msg)
 void msg_req_headers(char *msg,
                      const httpmsg_t *req)
 {
-  int i = 0;
+  int i;
   char *ret = msg;
 
   /* start line */
@@ -321,15 +299,14 @@ void msg_req_headers(char *msg,
   *ret++ = LF;
 
   /* headers */
-  do {
+  for (i = 0; i < req->num_headers; i++) {
     ret = strbld(ret, req->headers[i].key);
     *ret++ = ':';
     *ret++ = ' ';
     ret = strbld(ret, req->headers[i].value);
     *ret++ = CR;
     *ret++ = LF;
-    i++;
-  } while (i < req->num_headers);
+  }
 
   /* ending CRLF */
   *ret++ = CR;
@@ -339,7 +316,7 @@ void msg_req_headers(char *msg,
 void msg_rep_headers(char *msg,
                      const httpmsg_t *rep)
 {
-  int i = 0;
+  int i;
   unsigned char code[16];
   char *ret;
 
@@ -357,15 +334,14 @@ void msg_rep_headers(char *msg,
   *ret++ = LF;
 
   /* headers */
-  do {
+  for (i = 0; i < rep->num_headers; i++) {
     ret = strbld(ret, rep->headers[i].key);
     *ret++ = ':';
     *ret++ = ' ';
     ret = strbld(ret, rep->headers[i].value);
     *ret++ = CR;
     *ret++ = LF;
-    i++;
-  } while (i < rep->num_headers);
+  }
 
   /* ending CRLF */
   *ret++ = CR;
@@ -30,6 +30,7 @@ struct _httphdr {
 typedef struct _httpmsg httpmsg_t;
 
 struct _httpmsg {
+  struct _arena *arena;  /* of the connection, reset after the reply */
   int method;
   char *path;
   int ver_major;
@@ -50,7 +51,7 @@ struct _httpmsg {
 };
 
 
-httpmsg_t *msg_new();
+httpmsg_t *msg_new(struct _arena *arena);
 
 void msg_set_body_start(httpmsg_t *msg,
                         unsigned char *s);
@@ -66,13 +67,12 @@ void msg_add_zipped_body(httpmsg_t *msg,
 void msg_destroy(httpmsg_t *msg,
                  const int delbody);
 
-int msg_split(unsigned char *lines[],
+int msg_split(struct _arena *arena,
+              unsigned char *lines[],
               int *nlines,
               int *len_body,
-              const unsigned char *buf);
-
-void msg_lines_destroy(unsigned char *lines[],
-                       const int count);
+              const unsigned char *buf,
+              const int len);
 
 void msg_set_req_line(httpmsg_t *msg,
                       const char *method,
@@ -7,30 +7,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "arena.h"
 #include "http_msg.h"
 
 //#define DEBUG
 #include "debug.h"
 
 
-static int _fill_lines(unsigned char *lines[],
+static int _fill_lines(arena_t *arena,
+                       unsigned char *lines[],
                        int *nlines,
                        int *len_body,
                        int *count,
-                       const unsigned char *buf)
+                       const unsigned char *buf,
+                       const int len)
 {
   if (!buf) return MSG_EMPTY;
 
   *nlines = 0;
-  *count = msg_split(lines, nlines, len_body, buf);
+  *count = msg_split(arena, lines, nlines, len_body, buf, len);
   if (!*count) {
     D_PRINT("Empty message!!!\n");
     return MSG_EMPTY;
   }
 
-  if (*count < 3) {
+  /* the start line and the empty one, the lines are the arena's */
+  if (*count < 2) {
     D_PRINT("Incomplete message!!!\n");
-    msg_lines_destroy(lines, *count);
     return MSG_IMCOMPLETE;
   }
 
@@ -44,27 +47,24 @@ static int _fill_msg(httpmsg_t *msg,
                      const int count)
 {
   /* headers */
-  if (!msg_add_headers(msg, lines, nlines)) {
-    msg_lines_destroy(lines, count);
-    msg_destroy(msg, 1);
-    return MSG_EMPTY;
-  }
+  if (!msg_add_headers(msg, lines, nlines)) return MSG_EMPTY;
 
   /* body */
   if (len_body > 0) {
     msg_add_body(msg, lines[count], len_body);
   }
 
-  msg_lines_destroy(lines, count);
   return MSG_OK;
 }
 
-httpmsg_t *http_parse_req(const unsigned char *buf)
+httpmsg_t *http_parse_req(arena_t *arena,
+                          const unsigned char *buf,
+                          const int len)
 {
   unsigned char *lines[MAX_NUM_MSG_LINES];  /* http messages lines */
   int nlines, count, len_body;
 
-  int rc = _fill_lines(lines, &nlines, &len_body, &count, buf);
+  int rc = _fill_lines(arena, lines, &nlines, &len_body, &count, buf, len);
   if (rc != MSG_OK) return NULL;
 
   /* request line ... */
@@ -72,10 +72,11 @@ httpmsg_t *http_parse_req(const unsigned char *buf)
   char *method = strtok_r(rest, " ", &rest);
   char *path = strtok_r(NULL, " ", &rest);
   char *version = strtok_r(NULL, " ", &rest);
+  if (!path || !version || strlen(version) < 8) return NULL;
   int major = version[5] - '0';
   int minor = version[7] - '0';
 
-  httpmsg_t *req = msg_new();
+  httpmsg_t *req = msg_new(arena);
 
   if (strcmp(path, "/") == 0)
     msg_set_req_line(req, method, "/demo/index.html", major, minor);
@@ -88,24 +89,27 @@ httpmsg_t *http_parse_req(const unsigned char *buf)
   return req;
 }
 
-httpmsg_t *http_parse_rep(const unsigned char *buf)
+httpmsg_t *http_parse_rep(arena_t *arena,
+                          const unsigned char *buf,
+                          const int len)
 {
   unsigned char *lines[MAX_NUM_MSG_LINES];  /* http messages lines */
   int nlines, count, len_body;
 
-  int rc = _fill_lines(lines, &nlines, &len_body, &count, buf);
+  int rc = _fill_lines(arena, lines, &nlines, &len_body, &count, buf, len);
   if (rc != MSG_OK) return NULL;
 
   /* status line ... */
   char *rest = (char *)lines[0];
   char *version = strtok_r(rest, " ", &rest);
+  char *code = strtok_r(NULL, " ", &rest);
+  char *status = strtok_r(NULL, " ", &rest);
+  if (!status || strlen(version) < 8) return NULL;
   int major = version[5] - '0';
   int minor = version[7] - '0';
-  int code = atoi(strtok_r(NULL, " ", &rest));
-  char *status = strtok_r(NULL, " ", &rest);
 
-  httpmsg_t *rep = msg_new();
-  msg_set_rep_line(rep, major, minor, code, status);
+  httpmsg_t *rep = msg_new(arena);
+  msg_set_rep_line(rep, major, minor, atoi(code), status);
 
   rc = _fill_msg(rep, lines, nlines, len_body, count);
   if (rc != MSG_OK) return NULL;
@@ -8,8 +8,12 @@
 #define _HTTP_PARSER_H_
 
 
-httpmsg_t *http_parse_req(const unsigned char *buf);
-httpmsg_t *http_parse_rep(const unsigned char *buf);
+httpmsg_t *http_parse_req(struct _arena *arena,
+                          const unsigned char *buf,
+                          const int len);
+httpmsg_t *http_parse_rep(struct _arena *arena,
+                          const unsigned char *buf,
+                          const int len);
 
 
 #endif
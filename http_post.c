@@ -7,18 +7,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <libpq-fe.h>
 #include "io.h"
 #include "base64.h"
 #include "deflate.h"
+#include "inflate.h"
+#include "mime.h"
+#include "zpolicy.h"
 #include "util.h"
 #include "linkedlist.h"
+#include "arena.h"
 #include "jsmn.h"
+#include "json.h"
+#include "flight.h"
+#include "thpool.h"
 #include "pg_conn.h"
 #include "sqlobj.h"
 #include "sqlops.h"
+#include "sqlcache.h"
+#include "sqlwrite.h"
+#include "snapshot.h"
+#include "backend.h"
 #include "http_msg.h"
+#include "http_conn.h"
 #include "http_post.h"
 
 
@@ -26,57 +42,912 @@
 #include "debug.h"
 
 
-static void _process_json(char *sqlres,
-                          PGconn *pgconn,
-                          const httpmsg_t *req)
+#define POST_BODY_MAX 16777216  /* 16M, limit of a decompressed body */
+#define POST_ZIP_RATIO 64       /* a json body inflated beyond it is refused */
+#define EXPORT_PATH "/export/"  /* GET /export/<table>.csv or .ndjson */
+
+
+/*
+ * inflate a body sent with "Content-Encoding: gzip" or "deflate",
+ * returns a new buffer with the decompressed json (NUL terminated) or
+ * NULL if the body is not compressed or it is broken
+ */
+static char *_inflate_body(int *len,
+                           const httpmsg_t *req)
 {
-  /* process the request message here */
-  char *body = (char *)req->body;
-  D_PRINT("[REQ] json string: %s\n", body);
+  char *enc = msg_header_value(req, "Content-Encoding");
+  if (!enc || !req->body || req->len_body < 2) return NULL;
 
-  sqlobj_t *sqlo = sql_parse_json(body, req->len_body);
+  int gzip = strstr(enc, "gzip") != NULL;
+  if (!gzip && !strstr(enc, "deflate")) return NULL;
 
-  if (sqlo) {
-    /* this is the microservice */
-    if (strcmp(sqlo->cmd, "SELECT") == 0) {
-      sql_fetch(sqlres, pgconn, sqlo);
-    }
-    sqlobj_destroy(sqlo);
+  /* "deflate" means zlib, but some clients send raw deflate */
+  const unsigned char *in = req->body;
+  int zlib = !gzip && (in[0] & 0x0f) == 8 && ((in[0] << 8) | in[1]) % 31 == 0;
+
+  /* one attempt: a body which doesn't fit the ratio is refused */
+  long cap = gzip ? gzip_size(in, req->len_body)
+                  : req->len_body * (long)POST_ZIP_RATIO;
+  if (cap < 0) return NULL;
+  if (cap > POST_BODY_MAX) {
+    if (gzip) return NULL;
+    cap = POST_BODY_MAX;
   }
+  if (cap < 1024) cap = 1024;
+
+  char *out = malloc(cap + 1);
+  if (!out) return NULL;
+  int n;
+  if (gzip)
+    n = gzinflate(out, cap, in, req->len_body);
+  else if (zlib)
+    n = zinflate(out, cap, in, req->len_body);
+  else
+    n = inflate(out, cap, in, req->len_body);
+
+  if (n >= 0) {
+    out[n] = '\0';
+    *len = n;
+    return out;
+  }
+  free(out);
+
+  D_PRINT("[REQ] broken compressed body\n");
+  return NULL;
 }
 
-void http_post(const int clifd,
-               PGconn *pgconn,
-               const char *path,
-               const httpmsg_t *req)
+static void _send_status(arena_t *arena,
+                         const int clifd,
+                         const int code,
+                         const char *status)
 {
-  /* connect to database after receiving request */
-  char sqlres[2048];
-  _process_json(sqlres, pgconn, req);
+  httpmsg_t *rep = msg_new(arena);
+  msg_set_rep_line(rep, 1, 1, code, status);
+  msg_add_header(rep, "Server", SVR_VERSION);
+  msg_add_header(rep, "Connection", "keep-alive");
+  if (code == 503) msg_add_header(rep, "Retry-After", "1");
+  msg_add_header(rep, "Content-Length", "0");
 
-  httpmsg_t *rep = msg_new();
+  int len_headers = msg_headers_len(rep);
+  char *headers = arena_alloc(arena, len_headers);
+  msg_rep_headers(headers, rep);
+  io_socket_write(clifd, (unsigned char *)headers, len_headers);
+}
+
+static void _send_headers(arena_t *arena,
+                          const int clifd,
+                          const sqlreq_t *q)
+{
+  httpmsg_t *rep = msg_new(arena);
   msg_add_header(rep, "Server", SVR_VERSION);
   msg_add_header(rep, "Connection", "keep-alive");
   msg_add_header(rep, "Accept-Ranges", "bytes");
   msg_set_rep_line(rep, 1, 1, 200, "OK");
+  if (q && q->export)
+    msg_add_header(rep, "Content-Type", q->export == SQL_EXPORT_CSV ?
+                                        "text/csv" : "application/x-ndjson");
+  if (q && q->zip) {
+    msg_add_header(rep, "Content-Encoding", "deflate");
+    msg_add_header(rep, "Vary", "Accept-Encoding");
+  }
   msg_add_header(rep, "Transfer-Encoding", "chunked");
 
   int len_headers = msg_headers_len(rep);
-  char *headers = malloc(len_headers);
+  char *headers = arena_alloc(arena, len_headers);
   msg_rep_headers(headers, rep);
 
   /* send msg */
   D_PRINT("[PREP] Sending reply headers... %d\n", clifd);
   io_socket_write(clifd, (unsigned char *)headers, len_headers);
+}
 
-  /* send chunks */
-  D_PRINT("[PREP] Sending chunks... %d\n", clifd);
-  io_send_chunk(clifd, sqlres);
-
+static void _send_end(const int clifd)
+{
   /* terminating the chuncked transfer */
   D_PRINT("[PREP] Sending terminating chunk... %d\n", clifd);
   io_socket_write(clifd, (unsigned char *)"0\r\n\r\n", 5);
+}
+
+/* a cached result is complete, so it goes out in one piece */
+static void _send_cached(arena_t *arena,
+                         const int clifd,
+                         const sqlentry_t *entry,
+                         const httpmsg_t *req)
+{
+  char *zip_enc = msg_header_value(req, "Accept-Encoding");
+  int zipped = entry->body_zipped && zip_enc && strstr(zip_enc, "deflate");
+
+  httpmsg_t *rep = msg_new(arena);
+  msg_set_rep_line(rep, 1, 1, 200, "OK");
+  msg_add_header(rep, "Server", SVR_VERSION);
+  msg_add_header(rep, "Connection", "keep-alive");
+  msg_add_header(rep, "Vary", "Accept-Encoding");
+  if (zipped) msg_add_header(rep, "Content-Encoding", "deflate");
+
+  int len_body = zipped ? entry->len_zipped : entry->len_body;
+  char len_str[16];
+  int len = itos((unsigned char *)len_str, len_body, 10, ' ');
+  len_str[len] = '\0';
+  msg_add_header(rep, "Content-Length", len_str);
+
+  int len_headers = msg_headers_len(rep);
+  char *headers = arena_alloc(arena, len_headers);
+  msg_rep_headers(headers, rep);
+
+  D_PRINT("[PREP] Sending cached reply of %d... %d\n", len_body, clifd);
+  io_socket_write(clifd, (unsigned char *)headers, len_headers);
+  io_socket_write(clifd, zipped ? entry->body_zipped :
+                                  (unsigned char *)entry->body, len_body);
+}
+
+/* a json reply which is complete, it goes out in one piece */
+static void _send_json(arena_t *arena,
+                       const int clifd,
+                       const char *body,
+                       const int len_body)
+{
+  httpmsg_t *rep = msg_new(arena);
+  msg_set_rep_line(rep, 1, 1, 200, "OK");
+  msg_add_header(rep, "Server", SVR_VERSION);
+  msg_add_header(rep, "Connection", "keep-alive");
+  msg_add_header(rep, "Content-Type", "application/json");
+  char len_str[16];
+  itos((unsigned char *)len_str, len_body, 10, ' ');
+  msg_add_header(rep, "Content-Length", len_str);
+
+  int len_headers = msg_headers_len(rep);
+  char *headers = arena_alloc(arena, len_headers);
+  msg_rep_headers(headers, rep);
+
+  D_PRINT("[PREP] Sending json reply of %d... %d\n", len_body, clifd);
+  io_socket_write(clifd, (unsigned char *)headers, len_headers);
+  io_socket_write(clifd, (unsigned char *)body, len_body);
+}
+
+/* the rows a write changed, once it is committed */
+static void _send_written(arena_t *arena,
+                          const int clifd,
+                          const int rc,
+                          const long nrows)
+{
+  if (rc != SQL_DONE) {
+    _send_status(arena, clifd, 500, "Internal Server Error");
+    return;
+  }
+
+  char body[32];
+  char *ret = strbld(body, "{\"rows\":");
+  ret += itos((unsigned char *)ret, nrows, 10, ' ');
+  ret = strbld(ret, "}");
+  _send_json(arena, clifd, body, ret - body);
+}
+
+/* the socket of the client (0) or of a follower of the query */
+static int _fan_fd(httpconn_t *conn,
+                   sqlreq_t *q,
+                   const int i)
+{
+  return i ? q->fans[i - 1]->sockfd : conn->sockfd;
+}
+
+/* the group commit is done, called on a worker */
+static void _written(void *arg,
+                     const sqlobj_t *sqlo,
+                     const int rc,
+                     const long nrows)
+{
+  httpconn_t *conn = (httpconn_t *)arg;
+
+  /* the next SELECT of the client must see its own write */
+  if (rc == SQL_DONE && conn->sqlcache)
+    sqlcache_invalidate(conn->sqlcache, sqlo->table);
+  _send_written(conn->arena, conn->sockfd, rc, nrows);
+  httpconn_rearm(conn);
+}
+
+/* no more followers once the reply starts, they'd miss its beginning */
+static void _land(httpconn_t *conn,
+                  sqlreq_t *q)
+{
+  if (!q->flight) return;
+  q->fans = malloc(FLIGHT_PARK_MAX * sizeof(httpconn_t *));
+  q->nfans = flight_land(conn->flights, q->flight, (void **)q->fans);
+  q->flight = NULL;
+}
+
+/*
+ * a deflated batch, every one is flushed to a byte boundary so the client
+ * can inflate the rows as they come; the last one closes the stream
+ */
+static void _send_zipped(const int clifd,
+                         sqlreq_t *q,
+                         const int last)
+{
+  unsigned char *zipped = malloc(deflate_bound(q->out.len));
+  int len = deflate_chunk(q->zip, zipped, q->out.buf, q->out.len,
+                          q->zlvl, last);
+  D_PRINT("[PREP] Sending deflated chunk of %d... %d\n", len, clifd);
+  io_send_chunk(clifd, (char *)zipped, len);
+  q->sent += len;
+  q->out.len = 0;
+  free(zipped);
+}
+
+/* a batch of rows goes out as a chunk, the headers before the first one */
+static void _send_batch(httpconn_t *conn,
+                        sqlreq_t *q,
+                        const int last)
+{
+  int i;
+  if (!q->sent) {
+    /* the rows flow, only a client who leaves cancels the query now */
+    conn->deadline = 0;
+    _land(conn, q);
+    for (i = 0; i <= q->nfans; i++)
+      _send_headers(conn->arena, _fan_fd(conn, q, i), q);
+  }
+  if (q->zip) {
+    if (q->out.len || last) _send_zipped(conn->sockfd, q, last);
+    return;
+  }
+  if (q->out.len) {
+    if (q->copy) {
+      int need = q->len_copy + q->out.len;
+      if (need > SQLCACHE_ENTRY_MAX) {
+        free(q->copy);
+        q->copy = NULL;
+      }
+      else {
+        if (need > q->cap_copy) {
+          while (q->cap_copy < need) q->cap_copy *= 2;
+          q->copy = realloc(q->copy, q->cap_copy);
+        }
+        memcpy(q->copy + q->len_copy, q->out.buf, q->out.len);
+        q->len_copy += q->out.len;
+      }
+    }
+    D_PRINT("[PREP] Sending chunk of %d... %d\n", q->out.len, conn->sockfd);
+    for (i = 0; i <= q->nfans; i++)
+      io_send_chunk(_fan_fd(conn, q, i), q->out.buf, q->out.len);
+    q->sent += q->out.len;
+    q->out.len = 0;
+  }
+}
+
+/* (un)register the socket of the db connection, events go to the client */
+static void _pg_watch(httpconn_t *conn,
+                      const int op)
+{
+  struct epoll_event event;
+  event.data.ptr = (void *)conn;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  /* the queries don't fit the socket yet, the rest goes when writable */
+  if (op != EPOLL_CTL_DEL && conn->backend->flush(conn->sqlreq))
+    event.events |= EPOLLOUT;
+
+  int pgfd = conn->backend->socket(conn->sqlreq);
+  if (epoll_ctl(conn->epfd, op, pgfd, &event) == -1)
+    perror("epoll_ctl()...");
+}
+
+/* the time left for a checkout, the deadline counts the wait */
+static long _pool_wait(const httpconn_t *conn)
+{
+  long left = conn->deadline - mstime();
+  if (left > PG_POOL_WAIT) return PG_POOL_WAIT;
+  return left > 0 ? left : 0;
+}
+
+/* the query is sent, the event loop may cancel it from now on */
+static void _watch_query(httpconn_t *conn,
+                         sqlreq_t *q)
+{
+  conn->cancel = conn->backend->cancel(q);
+  conn->sqlreq = q;
+  _pg_watch(conn, EPOLL_CTL_ADD);
+}
+
+/* the query is over, unless the event loop took the cancel already */
+static void _unwatch_query(httpconn_t *conn)
+{
+  _pg_watch(conn, EPOLL_CTL_DEL);
+  PGcancel *cancel = __sync_lock_test_and_set(&conn->cancel, NULL);
+  if (cancel) PQfreeCancel(cancel);
+  conn->sqlreq = NULL;
+}
+
+static void _finish(httpconn_t *conn,
+                    sqlreq_t *q,
+                    const int rc)
+{
+  int i;
+  conn->backend->release(conn->backend, q);
+  _land(conn, q);
+
+  if (rc == SQL_DONE) {
+    _send_batch(conn, q, 1);
+    for (i = 0; i <= q->nfans; i++) _send_end(_fan_fd(conn, q, i));
+
+    if (q->copy) {
+      char key[SQLCACHE_KEY_SIZE];
+      sqlcache_key(key, q->sqlo[0]);
+      sqlcache_put(conn->sqlcache, key, q->sqlo[0]->table,
+                   realloc(q->copy, q->len_copy + 1), q->len_copy, q->gen);
+      q->copy = NULL;
+    }
+  }
+  else if (!q->sent) {
+    /* no connection, cancelled at the deadline, or it failed on its own */
+    int late = conn->deadline && mstime() >= conn->deadline;
+    for (i = 0; i <= q->nfans; i++) {
+      if (rc == SQL_BUSY)
+        _send_status(conn->arena, _fan_fd(conn, q, i), 503,
+                     "Service Unavailable");
+      else if (late)
+        _send_status(conn->arena, _fan_fd(conn, q, i), 504,
+                     "Gateway Timeout");
+      else
+        _send_status(conn->arena, _fan_fd(conn, q, i), 500,
+                     "Internal Server Error");
+    }
+  }
+  else {
+    /* too late for a status, a truncated reply must not look complete */
+    D_PRINT("[PREP] query failed while streaming, closing %d\n", conn->sockfd);
+    for (i = 0; i <= q->nfans; i++) shutdown(_fan_fd(conn, q, i), SHUT_RDWR);
+  }
+
+  for (i = 0; i < q->nfans; i++) httpconn_rearm(q->fans[i]);
+  sqlreq_destroy(q);
+  flight_release(conn->flights, &conn->flight);
+}
+
+/*
+ * the queries are sent, returns 1 if they are in flight; a backend which
+ * has the rows at hand is drained here and then
+ */
+static int _start(httpconn_t *conn,
+                  sqlreq_t *q,
+                  int rc)
+{
+  if (rc == SQL_WAIT) {
+    /* no worker waits for the database */
+    _watch_query(conn, q);
+    return 1;
+  }
+
+  while (rc == SQL_MORE) {
+    rc = conn->backend->resume(conn->backend, q);
+    if (rc == SQL_MORE) _send_batch(conn, q, 0);
+  }
+  if (rc == SQL_WAIT) rc = SQL_ERROR;
+  _finish(conn, q, rc);
+  return 0;
+}
+
+/* a json array of writes, each runs as soon as its object has come */
+typedef struct _postitem {
+  struct _postbatch *batch;
+  int rc;                 /* SQL_DONE, SQL_ERROR, or SQL_WAIT while it runs */
+  long nrows;
+  struct _postitem *next;
+} postitem_t;
+
+typedef struct _postbatch {
+  httpconn_t *conn;
+  sqlstream_t *stream;
+  int writes;             /* the first object is a write, so are the rest */
+  sqlobj_t *sqlos[SQL_BATCH_MAX];  /* or the SELECTs, run once all are in */
+  int nsqlo;
+  postitem_t *head;
+  postitem_t *tail;
+  int nitems;
+  int ok;                 /* the array was well formed */
+  int refused;            /* 400 or 413, the SELECTs can't all be answered */
+  volatile int left;      /* writes not done, plus one until the body ends */
+} postbatch_t;
+
+
+/*
+ * the SELECTs of a request, or a single write; returns 1 if a query is in
+ * flight, the connection is then resumed by http_post_resume()
+ */
+static int _post_sqlos(httpconn_t *conn,
+                       const httpmsg_t *req,
+                       sqlobj_t *sqlos[],
+                       const int nsqlo,
+                       const int array)
+{
+  conn->deadline = mstime() + PG_DEADLINE;
+
+  /* a single INSERT, UPDATE or DELETE joins the next group commit */
+  if (!array && strcmp(sqlos[0]->cmd, "SELECT") != 0) {
+    if (!conn->writer) {
+      sqlobj_destroy(sqlos[0]);
+      _send_status(conn->arena, conn->sockfd, 501, "Not Implemented");
+      return 0;
+    }
+    if (sql_write(conn->writer, sqlos[0], _written, conn)) return 1;
+    sqlobj_destroy(sqlos[0]);
+    _send_status(conn->arena, conn->sockfd, 400, "Bad Request");
+    return 0;
+  }
+
+  /* a json array serves the SELECTs */
+  int i;
+  int nsel = 0;
+  for (i = 0; i < nsqlo; i++) {
+    if (strcmp(sqlos[i]->cmd, "SELECT") == 0)
+      sqlos[nsel++] = sqlos[i];
+    else
+      sqlobj_destroy(sqlos[i]);
+  }
+  if (!nsel) {
+    _send_json(conn->arena, conn->sockfd, "[]", 2);
+    return 0;
+  }
+
+  /* a table kept in memory answers without the database */
+  if (!array && conn->snapshot) {
+    jsonbuf_t out;
+    json_init(&out, SQL_BUF_SIZE);
+    if (snapshot_select(conn->snapshot, sqlos[0], &out)) {
+      D_PRINT("[PREP] served from the %s snapshot\n", sqlos[0]->table);
+      sqlobj_destroy(sqlos[0]);
+      _send_json(conn->arena, conn->sockfd, out.buf, out.len);
+      json_free(&out);
+      return 0;
+    }
+    json_free(&out);
+  }
+
+  /* a single SELECT may be answered from the result cache */
+  char key[SQLCACHE_KEY_SIZE];
+  long gen = conn->sqlcache ? conn->sqlcache->gen : 0;
+  int keyed = !array && sqlcache_key(key, sqlos[0]);
+  if (keyed && conn->sqlcache) {
+    sqlentry_t *entry = sqlcache_get(conn->sqlcache, key);
+    if (entry) {
+      D_PRINT("[PREP] cache hit: %s\n", key);
+      sqlobj_destroy(sqlos[0]);
+      _send_cached(conn->arena, conn->sockfd, entry, req);
+      sqlcache_release(entry);
+      return 0;
+    }
+  }
+
+  /* the same SELECT is in flight, its reply is sent here as well */
+  flight_t *flight = NULL;
+  if (keyed) {
+    int leader;
+    flight = flight_take(conn->flights, key, &leader);
+    if (!leader) {
+      if (flight_park(conn->flights, flight, conn)) {
+        D_PRINT("[PREP] %d joined a query in flight\n", conn->sockfd);
+        sqlobj_destroy(sqlos[0]);
+        return 1;
+      }
+      flight = NULL;
+    }
+    else {
+      /* the client's leaving won't cancel the query for the others */
+      flight_hold(conn->flights, flight);
+      conn->flight = flight;
+    }
+  }
+
+  sqlreq_t *q = sqlreq_new(NULL, SQL_BATCH_SIZE);
+  for (i = 0; i < nsel; i++) sqlreq_add(q, sqlos[i]);
+  q->array = array;
+  q->flight = flight;
+  if (keyed && conn->sqlcache) {
+    q->copy = malloc(SQL_BUF_SIZE);
+    q->cap_copy = SQL_BUF_SIZE;
+    q->gen = gen;
+  }
+
+  /* a database connection is checked out after receiving the request */
+  int rc = conn->backend->query(conn->backend, q, _pool_wait(conn));
+  if (rc == SQL_BUSY)
+    D_PRINT("[PREP] no database connection for %d\n", conn->sockfd);
+  return _start(conn, q, rc);
+}
+
+static void _batch_free(postbatch_t *b)
+{
+  postitem_t *item;
+  int i;
+
+  for (i = 0; i < b->nsqlo; i++) sqlobj_destroy(b->sqlos[i]);
+  while ((item = b->head)) {
+    b->head = item->next;
+    free(item);
+  }
+  sql_stream_destroy(b->stream);
+  free(b);
+}
+
+/* [{"rows":n}, ...] in the order of the array, null for a failed write */
+static void _batch_reply(httpconn_t *conn)
+{
+  postbatch_t *b = conn->batch;
+  postitem_t *item;
+
+  conn->batch = NULL;
+
+  if (!b->ok || b->refused == 400)
+    _send_status(conn->arena, conn->sockfd, 400, "Bad Request");
+  else if (b->refused == 413)
+    _send_status(conn->arena, conn->sockfd, 413, "Payload Too Large");
+  else {
+    char *body = arena_alloc(conn->arena, b->nitems * 32 + 3);
+    char *ret = strbld(body, "[");
+    for (item = b->head; item; item = item->next) {
+      if (item != b->head) ret = strbld(ret, ",");
+      if (item->rc != SQL_DONE) {
+        ret = strbld(ret, "null");
+        continue;
+      }
+      ret = strbld(ret, "{\"rows\":");
+      ret += itos((unsigned char *)ret, item->nrows, 10, ' ');
+      ret = strbld(ret, "}");
+    }
+    ret = strbld(ret, "]");
+    _send_json(conn->arena, conn->sockfd, body, ret - body);
+  }
+  _batch_free(b);
+}
+
+/* a write of the array is committed, called on a worker */
+static void _batch_written(void *arg,
+                           const sqlobj_t *sqlo,
+                           const int rc,
+                           const long nrows)
+{
+  postitem_t *item = (postitem_t *)arg;
+  httpconn_t *conn = item->batch->conn;
+
+  if (rc == SQL_DONE && conn->sqlcache)
+    sqlcache_invalidate(conn->sqlcache, sqlo->table);
+  item->nrows = nrows;
+  item->rc = rc;
+
+  /* the body is all in, the last write answers for the array */
+  if (__sync_sub_and_fetch(&item->batch->left, 1) == 0) {
+    _batch_reply(conn);
+    httpconn_rearm(conn);
+  }
+  /* the last use of the connection, the event loop may free it now */
+  __sync_fetch_and_sub(&conn->writes, 1);
+}
+
+/* an object of the array has closed, a write goes to the writer now */
+static void _batch_elem(void *arg,
+                        sqlobj_t *sqlo)
+{
+  postbatch_t *b = (postbatch_t *)arg;
+  int write = strcmp(sqlo->cmd, "SELECT") != 0;
+
+  if (b->stream->nelems == 1) b->writes = write;
+  if (!b->writes) {
+    /* one reply for all of them: no write in it, and no more than fit */
+    if (write) b->refused = 400;
+    else if (b->nsqlo == SQL_BATCH_MAX && !b->refused) b->refused = 413;
+    if (!b->refused) b->sqlos[b->nsqlo++] = sqlo;
+    else sqlobj_destroy(sqlo);
+    return;
+  }
+
+  postitem_t *item = calloc(1, sizeof(struct _postitem));
+  item->batch = b;
+  item->rc = SQL_WAIT;
+  if (b->tail) b->tail->next = item;
+  else b->head = item;
+  b->tail = item;
+  b->nitems++;
+
+  __sync_fetch_and_add(&b->left, 1);
+  __sync_fetch_and_add(&b->conn->writes, 1);
+  if (!write || !b->conn->writer ||
+      !sql_write(b->conn->writer, sqlo, _batch_written, item)) {
+    item->rc = SQL_ERROR;
+    __sync_fetch_and_sub(&b->left, 1);
+    __sync_fetch_and_sub(&b->conn->writes, 1);
+    sqlobj_destroy(sqlo);
+  }
+}
+
+static void _batch_new(httpconn_t *conn)
+{
+  postbatch_t *b = calloc(1, sizeof(struct _postbatch));
+  b->conn = conn;
+  b->stream = sql_stream_new();
+  b->left = 1;
+  conn->batch = b;
+}
+
+/*
+ * the body of the array is all in: the SELECTs go in one pipeline, the
+ * writes are answered once the last of them is committed
+ */
+static int _batch_end(httpconn_t *conn,
+                      const httpmsg_t *req)
+{
+  postbatch_t *b = conn->batch;
+  b->ok = b->stream->state == SQL_STREAM_END;
+
+  if (!b->writes && b->ok && !b->refused) {
+    /* the batch goes first, the reply may be over before _post_sqlos is */
+    conn->batch = NULL;
+    int pending = _post_sqlos(conn, req, b->sqlos, b->nsqlo, 1);
+    b->nsqlo = 0;
+    _batch_free(b);
+    return pending;
+  }
+  if (!b->writes) {
+    _batch_reply(conn);
+    return 0;
+  }
+
+  if (__sync_sub_and_fetch(&b->left, 1)) return 1;
+  _batch_reply(conn);
+  return 0;
+}
+
+static int _is_array(const unsigned char *body,
+                     const size_t len)
+{
+  size_t k = 0;
+  while (k < len && strchr(" \t\r\n", body[k])) k++;
+  return k < len && body[k] == '[';
+}
+
+/* the body is all in, it was kept because it is compressed or no array */
+static int _post_body(httpconn_t *conn,
+                      const httpmsg_t *req)
+{
+  /* process the request message here */
+  int len = req->len_body;
+  char *zbody = _inflate_body(&len, req);
+  char *body = zbody ? zbody : (char *)req->body;
+  D_PRINT("[REQ] json string: %.*s\n", len, body);
+
+  if (_is_array((unsigned char *)body, len)) {
+    _batch_new(conn);
+    sql_stream_feed(conn->batch->stream, body, len, _batch_elem,
+                    conn->batch);
+    if (zbody) free(zbody);
+    return _batch_end(conn, req);
+  }
+
+  sqlobj_t *sqlos[1];
+  sqlos[0] = len ? sql_parse_json(body, len) : NULL;
+  if (zbody) free(zbody);
+  if (!sqlos[0]) {
+    _send_status(conn->arena, conn->sockfd, 400, "Bad Request");
+    return 0;
+  }
+  return _post_sqlos(conn, req, sqlos, 1, 0);
+}
+
+/*
+ * the request stays with the connection until its body is all in; an
+ * array is fed to the parser as it arrives, so its writes start before
+ * the upload ends; returns 1 if the connection must not be rearmed
+ */
+int http_post_more(httpconn_t *conn,
+                   const unsigned char *bytes,
+                   const int len)
+{
+  httpmsg_t *req = conn->req;
+  size_t n = len < conn->len_left ? len : conn->len_left;
+  int pending = 0;
+
+  conn->len_left -= n;
+  if (!conn->batch) {
+    if (req->len_body + n > POST_BODY_MAX) {
+      _send_status(conn->arena, conn->sockfd, 413, "Payload Too Large");
+      shutdown(conn->sockfd, SHUT_RDWR);
+      http_post_drop(conn);
+      return 0;
+    }
+    /* the headers may come without any of the body */
+    if (n) {
+      req->body = realloc(req->body, req->len_body + n + 1);
+      memcpy(req->body + req->len_body, bytes, n);
+      req->len_body += n;
+      req->body[req->len_body] = '\0';
+    }
+
+    if (msg_header_value(req, "Content-Encoding") ||
+        !_is_array(req->body, req->len_body)) {
+      if (conn->len_left) return 0;
+
+      /*
+       * req is in the arena of the connection, which the next request
+       * resets: only the body, from malloc, is freed once it is served
+       */
+      unsigned char *body = req->body;
+      conn->req = NULL;
+      pending = _post_body(conn, req);
+      free(body);
+      return pending;
+    }
+
+    /* an array, what came so far goes to the parser */
+    _batch_new(conn);
+    bytes = req->body;
+    n = req->len_body;
+  }
+
+  sql_stream_feed(conn->batch->stream, (const char *)bytes, n, _batch_elem,
+                  conn->batch);
+  if (req->body) {
+    free(req->body);
+    req->body = NULL;
+    req->len_body = 0;
+  }
+  if (conn->len_left) return 0;
+
+  /* the next request may come in before _batch_end() returns */
+  conn->req = NULL;
+  return _batch_end(conn, req);
+}
+
+/*
+ * the request is the connection's until its body is all in, what came
+ * with the headers is fed like the rest
+ */
+int http_post(httpconn_t *conn,
+              const char *path,
+              httpmsg_t *req)
+{
+  char *cl = msg_header_value(req, "Content-Length");
+  long len_total = cl ? atol(cl) : (long)req->len_body;
+  if (len_total < 0) len_total = 0;
+
+  unsigned char *body = req->body;
+  size_t len = req->len_body < (size_t)len_total ? req->len_body : len_total;
+  req->body = NULL;
+  req->len_body = 0;
+  conn->req = req;
+  conn->len_left = len_total;
+
+  /* a client waiting for a go before the body */
+  char *expect = msg_header_value(req, "Expect");
+  if ((size_t)len_total > len && expect &&
+      strcasecmp(expect, "100-continue") == 0)
+    io_socket_write(conn->sockfd,
+                    (unsigned char *)"HTTP/1.1 100 Continue\r\n\r\n", 25);
+
+  /* what came with the headers is in the arena */
+  return http_post_more(conn, body, len);
+}
+
+/* the writes of a streamed array call back on the connection */
+/* a request cut off by the client, or its leftovers */
+void http_post_drop(httpconn_t *conn)
+{
+  if (conn->batch) _batch_free(conn->batch);
+  conn->batch = NULL;
+  msg_destroy(conn->req, 1);
+  conn->req = NULL;
+}
+
+/* the table and the format of an export path, 0 if it is not one */
+static int _export_format(char table[17],
+                          const char *path)
+{
+  const char *name = path + strlen(EXPORT_PATH);
+  int n = strcspn(name, ".?");
+  int i;
+
+  /* a plain identifier, it goes into the sql as it is */
+  if (n < 1 || n > 16) return 0;
+  for (i = 0; i < n; i++)
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_') return 0;
+  memcpy(table, name, n);
+  table[n] = '\0';
+
+  const char *ext = name + n;
+  int len_ext = strcspn(ext, "?");
+  if (len_ext == 4 && strncmp(ext, ".csv", 4) == 0) return SQL_EXPORT_CSV;
+  if (len_ext == 7 && strncmp(ext, ".ndjson", 7) == 0)
+    return SQL_EXPORT_NDJSON;
+  return 0;
+}
+
+int http_is_export(const char *path)
+{
+  return strncmp(path, EXPORT_PATH, strlen(EXPORT_PATH)) == 0;
+}
+
+/*
+ * GET /export/<table>.csv|.ndjson dumps a whole table with COPY, the rows
+ * are relayed in chunks as the database sends them, like http_post() it
+ * returns 1 while the export is in progress
+ */
+int http_export(httpconn_t *conn,
+                const char *path,
+                const httpmsg_t *req)
+{
+  conn->deadline = mstime() + PG_DEADLINE;
+
+  char table[17];
+  int format = _export_format(table, path);
+  if (!format) {
+    _send_status(conn->arena, conn->sockfd, 404, "Not Found");
+    return 0;
+  }
+  if (!conn->backend->export) {
+    _send_status(conn->arena, conn->sockfd, 501, "Not Implemented");
+    return 0;
+  }
+
+  sqlobj_t *sqlo = sqlobj_new(sizeof(table));
+  sqlo->table = arena_strndup(sqlo->arena, table, strlen(table));
+  sqlo->cmd = "SELECT";
+
+  sqlreq_t *q = sqlreq_new(NULL, SQL_BATCH_SIZE);
+  sqlreq_add(q, sqlo);
+
+  char *zip_enc = msg_header_value(req, "Accept-Encoding");
+  if (zip_enc && strstr(zip_enc, "deflate")) {
+    q->zlvl = zpolicy_level(format == SQL_EXPORT_CSV ?
+                            "text/csv" : "application/x-ndjson",
+                            MIME_TXT, SQL_BATCH_SIZE);
+    if (q->zlvl != ZP_NONE) q->zip = malloc(sizeof(struct sdefl));
+  }
+
+  int rc = conn->backend->export(conn->backend, q, format, _pool_wait(conn));
+  return _start(conn, q, rc);
+}
+
+/* returns 1 when the reply is sent and the client can be served again */
+int http_post_resume(httpconn_t *conn)
+{
+  sqlreq_t *q = conn->sqlreq;
+  int rc;
+
+  while ((rc = conn->backend->resume(conn->backend, q)) == SQL_MORE)
+    _send_batch(conn, q, 0);
+
+  if (rc == SQL_WAIT) {
+    _pg_watch(conn, EPOLL_CTL_MOD);
+    return 0;
+  }
+
+  _unwatch_query(conn);
+  _finish(conn, q, rc);
+  return 1;
+}
+
+static void _cancel(void *arg)
+{
+  pg_cancel((PGcancel *)arg);
+}
+
+/*
+ * called by the event loop for a connection with a query in flight, the
+ * query is cancelled past its deadline or when the client has left and
+ * no other joined it; the cancel is sent from a worker, the error the
+ * query then ends with is handled by http_post_resume()
+ */
+void http_post_check(httpconn_t *conn,
+                     const long now,
+                     thpool_t *tasks)
+{
+  char c;
+  long deadline = conn->deadline;
+  int n = recv(conn->sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  int gone = n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+  int late = deadline && now >= deadline;
+  if (!late && !(gone && flight_alone(conn->flights, &conn->flight)))
+    return;
 
-  free(headers);
-  msg_destroy(rep, 0);
+  PGcancel *cancel = __sync_lock_test_and_set(&conn->cancel, NULL);
+  if (!cancel) return;
+  D_PRINT("[PREP] cancelling the query of %d, %s\n", conn->sockfd,
+          gone ? "client gone" : "deadline passed");
+  thpool_add_task(tasks, _cancel, cancel);
 }
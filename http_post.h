@@ -9,10 +9,28 @@
 
 
 /* POST */
-void http_post(const int clifd,
-               PGconn *pgconn,
-               const char *path,
-               const httpmsg_t *req);
+int http_post(httpconn_t *conn,
+              const char *path,
+              httpmsg_t *req);
+
+int http_post_more(httpconn_t *conn,
+                   const unsigned char *bytes,
+                   const int len);
+
+void http_post_drop(httpconn_t *conn);
+
+int http_post_resume(httpconn_t *conn);
+
+void http_post_check(httpconn_t *conn,
+                     const long now,
+                     struct _thpool *tasks);
+
+/* GET, tables exported from the database */
+int http_is_export(const char *path);
+
+int http_export(httpconn_t *conn,
+                const char *path,
+                const httpmsg_t *req);
 
 
 #endif
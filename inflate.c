@@ -0,0 +1,499 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memcpy_sse2.h"
+#include "deflate.h"
+#include "inflate.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+#define SINFL_MAX_BITS  15
+#define SINFL_FAST_BITS 10
+#define SINFL_FAST_SIZ  (1 << SINFL_FAST_BITS)
+#define SINFL_FAST_MSK  (SINFL_FAST_SIZ-1)
+#define SINFL_PRE_MAX   19
+#define SINFL_LIT_MAX   288
+#define SINFL_DST_MAX   32
+#define SINFL_EOB       256
+
+/*
+ * canonical huffman decoder, codes up to SINFL_FAST_BITS are decoded with
+ * a single lookup, the longer (rare) ones are walked code length by length
+ */
+struct sinfl_huff {
+  unsigned short fast[SINFL_FAST_SIZ];   /* (sym << 4) | len, 0: long code */
+  unsigned short cnt[SINFL_MAX_BITS + 1];  /* number of codes per length */
+  unsigned short sym[SINFL_LIT_MAX];       /* symbols ordered by code */
+};
+
+struct sinfl {
+  const unsigned char *in;
+  const unsigned char *end;
+  unsigned long long bitbuf;
+  int bitcnt;
+  int over;   /* zero bytes fed past the end of the input */
+  struct sinfl_huff lit;
+  struct sinfl_huff dst;
+};
+
+
+static void _refill(struct sinfl *s)
+{
+  if (s->end - s->in >= 8) {
+    /* branchless: load 8 bytes, keep the whole bytes that fit */
+    unsigned long long v;
+    memcpy(&v, s->in, 8);
+    s->bitbuf |= v << s->bitcnt;
+    s->in += (63 - s->bitcnt) >> 3;
+    s->bitcnt |= 56;
+  }
+  else {
+    while (s->bitcnt <= 56) {
+      unsigned long long b = 0;
+      if (s->in < s->end) b = *s->in++;
+      else s->over++;
+      s->bitbuf |= b << s->bitcnt;
+      s->bitcnt += 8;
+    }
+  }
+}
+
+static int _bits(struct sinfl *s,
+                 const int n)
+{
+  int v = (int)(s->bitbuf & ((1ull << n) - 1));
+  s->bitbuf >>= n;
+  s->bitcnt -= n;
+  return v;
+}
+
+static int _get(struct sinfl *s,
+                const int n)
+{
+  if (s->bitcnt < n) _refill(s);
+  return _bits(s, n);
+}
+
+static unsigned _rev(unsigned c,
+                     const int n)
+{
+  c = ((c & 0x5555) << 1) | ((c & 0xAAAA) >> 1);
+  c = ((c & 0x3333) << 2) | ((c & 0xCCCC) >> 2);
+  c = ((c & 0x0F0F) << 4) | ((c & 0xF0F0) >> 4);
+  c = ((c & 0x00FF) << 8) | ((c & 0xFF00) >> 8);
+  return c >> (16-n);
+}
+
+static int _build(struct sinfl_huff *h,
+                  const unsigned char *lens,
+                  const int n)
+{
+  unsigned short offs[SINFL_MAX_BITS + 2];
+  int i, len, left = 1;
+  unsigned code = 0;
+
+  memset(h->cnt, 0, sizeof(h->cnt));
+  for (i = 0; i < n; i++)
+    h->cnt[lens[i]]++;
+  h->cnt[0] = 0;
+
+  /* over-subscribed sets are invalid, incomplete ones are allowed */
+  for (len = 1; len <= SINFL_MAX_BITS; len++) {
+    left = (left << 1) - h->cnt[len];
+    if (left < 0) return SINFL_ERR_DATA;
+  }
+
+  offs[1] = 0;
+  for (len = 1; len < SINFL_MAX_BITS; len++)
+    offs[len + 1] = offs[len] + h->cnt[len];
+  for (i = 0; i < n; i++)
+    if (lens[i]) h->sym[offs[lens[i]]++] = (unsigned short)i;
+
+  /* fill the lookup table with the short codes (bit reversed) */
+  memset(h->fast, 0, sizeof(h->fast));
+  for (i = 0, len = 1; len <= SINFL_FAST_BITS; len++) {
+    int k;
+    for (k = 0; k < h->cnt[len]; k++, i++, code++) {
+      unsigned short e = (unsigned short)((h->sym[i] << 4) | len);
+      unsigned j;
+      for (j = _rev(code, len); j < SINFL_FAST_SIZ; j += 1u << len)
+        h->fast[j] = e;
+    }
+    code <<= 1;
+  }
+  return 0;
+}
+
+static int _decode_slow(struct sinfl *s,
+                        const struct sinfl_huff *h)
+{
+  unsigned long long b = s->bitbuf;
+  int code = 0, first = 0, index = 0, len;
+
+  for (len = 1; len <= SINFL_MAX_BITS; len++) {
+    int count = h->cnt[len];
+    code |= (int)(b & 1);
+    b >>= 1;
+    if (code - first < count) {
+      _bits(s, len);
+      return h->sym[index + (code - first)];
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return SINFL_ERR_DATA;
+}
+
+/* at least SINFL_MAX_BITS bits must be in the bit buffer */
+static int _decode(struct sinfl *s,
+                   const struct sinfl_huff *h)
+{
+  unsigned e = h->fast[s->bitbuf & SINFL_FAST_MSK];
+  if (e) {
+    _bits(s, e & 15);
+    return (int)(e >> 4);
+  }
+  return _decode_slow(s, h);
+}
+
+static int _fixed(struct sinfl *s)
+{
+  unsigned char lens[SINFL_LIT_MAX];
+  int i;
+  for (i = 0; i < 144; i++) lens[i] = 8;
+  for (; i < 256; i++) lens[i] = 9;
+  for (; i < 280; i++) lens[i] = 7;
+  for (; i < SINFL_LIT_MAX; i++) lens[i] = 8;
+  _build(&s->lit, lens, SINFL_LIT_MAX);
+  for (i = 0; i < 30; i++) lens[i] = 5;
+  return _build(&s->dst, lens, 30);
+}
+
+static int _dynamic(struct sinfl *s)
+{
+  static const unsigned char order[SINFL_PRE_MAX] = {16,17,18,0,8,7,9,6,10,5,
+                                                     11,4,12,3,13,2,14,1,15};
+  unsigned char lens[SINFL_LIT_MAX + SINFL_DST_MAX];
+  struct sinfl_huff *pre = &s->dst;  /* borrowed until the real one is built */
+  int i, n;
+
+  int nlit = _get(s, 5) + 257;
+  int ndst = _get(s, 5) + 1;
+  int npre = _get(s, 4) + 4;
+  if (nlit > 286 || ndst > 30) return SINFL_ERR_DATA;
+
+  memset(lens, 0, SINFL_PRE_MAX);
+  for (i = 0; i < npre; i++)
+    lens[order[i]] = (unsigned char)_get(s, 3);
+  if (_build(pre, lens, SINFL_PRE_MAX) < 0) return SINFL_ERR_DATA;
+
+  n = nlit + ndst;
+  for (i = 0; i < n;) {
+    int sym, rep;
+    unsigned char len = 0;
+    if (s->bitcnt < 32) _refill(s);
+    sym = _decode(s, pre);
+    if (sym < 0) return SINFL_ERR_DATA;
+    if (sym < 16) {
+      lens[i++] = (unsigned char)sym;
+      continue;
+    }
+    if (sym == 16) {
+      if (!i) return SINFL_ERR_DATA;
+      len = lens[i - 1];
+      rep = 3 + _bits(s, 2);
+    }
+    else if (sym == 17) rep = 3 + _bits(s, 3);
+    else rep = 11 + _bits(s, 7);
+    if (i + rep > n) return SINFL_ERR_DATA;
+    while (rep--) lens[i++] = len;
+  }
+  if (!lens[SINFL_EOB]) return SINFL_ERR_DATA;
+
+  if (_build(&s->lit, lens, nlit) < 0) return SINFL_ERR_DATA;
+  return _build(&s->dst, lens + nlit, ndst);
+}
+
+static int _block(struct sinfl *s,
+                  unsigned char **dst,
+                  unsigned char *out,
+                  unsigned char *oe)
+{
+  static const short lbase[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,
+                                  43,51,59,67,83,99,115,131,163,195,227,258};
+  static const unsigned char lext[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,
+                                         3,3,4,4,4,4,5,5,5,5,0};
+  static const unsigned short dbase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,
+                                           129,193,257,385,513,769,1025,1537,
+                                           2049,3073,4097,6145,8193,12289,
+                                           16385,24577};
+  static const unsigned char dext[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,
+                                         8,8,9,9,10,10,11,11,12,12,13,13};
+  unsigned char *o = *dst;
+
+  do {
+    int sym, len, dist;
+    const unsigned char *src;
+
+    /* the longest match (15+5+15+13 bits) fits in one refill */
+    if (s->bitcnt < 48) _refill(s);
+    sym = _decode(s, &s->lit);
+    if (sym < 0) return SINFL_ERR_DATA;
+    if (sym < 256) {
+      if (o >= oe) return SINFL_ERR_SPACE;
+      *o++ = (unsigned char)sym;
+      continue;
+    }
+    if (sym == SINFL_EOB) break;
+
+    sym -= 257;
+    if (sym >= 29) return SINFL_ERR_DATA;
+    len = lbase[sym] + _bits(s, lext[sym]);
+    sym = _decode(s, &s->dst);
+    if (sym < 0 || sym >= 30) return SINFL_ERR_DATA;
+    dist = dbase[sym] + _bits(s, dext[sym]);
+
+    if (dist > o - out) return SINFL_ERR_DATA;
+    if (len > oe - o) return SINFL_ERR_SPACE;
+
+    src = o - dist;
+    if (dist >= 8 && oe - o >= len + 8) {
+      /* may write up to 7 bytes past the match, still inside out */
+      do {
+        memcpy(o, src, 8);
+        o += 8;
+        src += 8;
+        len -= 8;
+      } while (len > 0);
+      o += len;
+    }
+    else {
+      while (len--) *o++ = *src++;
+    }
+  } while (1);
+
+  *dst = o;
+  return 0;
+}
+
+static int _stored(struct sinfl *s,
+                   unsigned char **dst,
+                   unsigned char *oe)
+{
+  const unsigned char *p;
+  int len, nlen;
+
+  _bits(s, s->bitcnt & 7);  /* byte align */
+  len = _get(s, 16);
+  nlen = _get(s, 16);
+  if ((len ^ 0xFFFF) != nlen) return SINFL_ERR_DATA;
+
+  /* give the bytes still in the bit buffer back to the input */
+  if ((s->bitcnt >> 3) < s->over) return SINFL_ERR_DATA;
+  p = s->in - (s->bitcnt >> 3) + s->over;
+  if (s->end - p < len) return SINFL_ERR_DATA;
+  if (oe - *dst < len) return SINFL_ERR_SPACE;
+
+  memcpy_fast(*dst, p, len);
+  *dst += len;
+  s->in = p + len;
+  s->bitbuf = 0;
+  s->bitcnt = 0;
+  s->over = 0;
+  return 0;
+}
+
+static int _inflate(unsigned char *out,
+                    const int cap,
+                    const unsigned char *in,
+                    const int size,
+                    int *used)
+{
+  struct sinfl s;
+  unsigned char *o = out;
+  unsigned char *oe = out + cap;
+  int last, type, rc;
+
+  s.in = in;
+  s.end = in + size;
+  s.bitbuf = 0;
+  s.bitcnt = 0;
+  s.over = 0;
+
+  do {
+    last = _get(&s, 1);
+    type = _get(&s, 2);
+    switch (type) {
+    case 0:
+      rc = _stored(&s, &o, oe);
+      break;
+    case 1:
+      _fixed(&s);
+      rc = _block(&s, &o, out, oe);
+      break;
+    case 2:
+      rc = _dynamic(&s);
+      if (rc == 0) rc = _block(&s, &o, out, oe);
+      break;
+    default:
+      rc = SINFL_ERR_DATA;
+    }
+    /* the zeros past a truncated input decode too, until out is full */
+    if (rc == SINFL_ERR_SPACE && s.over * 8 > s.bitcnt) rc = SINFL_ERR_DATA;
+    if (rc < 0) return rc;
+  } while (!last);
+
+  /* the stream ends on a byte boundary, the rest is the trailer */
+  _bits(&s, s.bitcnt & 7);
+  if ((s.bitcnt >> 3) < s.over) return SINFL_ERR_DATA;  /* truncated */
+  if (used) *used = (int)(s.in - in) - (s.bitcnt >> 3) + s.over;
+
+  return (int)(o - out);
+}
+
+int inflate(void *out,
+            const int cap,
+            const void *in,
+            const int size)
+{
+  return _inflate((unsigned char *)out, cap, (const unsigned char *)in,
+                  size, NULL);
+}
+
+static unsigned _load_be32(const unsigned char *p)
+{
+  return ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) |
+         ((unsigned)p[2] << 8) | (unsigned)p[3];
+}
+
+static unsigned _load_le32(const unsigned char *p)
+{
+  return ((unsigned)p[3] << 24) | ((unsigned)p[2] << 16) |
+         ((unsigned)p[1] << 8) | (unsigned)p[0];
+}
+
+int zinflate(void *out,
+             const int cap,
+             const void *in,
+             const int size)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  int n, used;
+
+  if (size < 6) return SINFL_ERR_DATA;
+  /* deflate, no preset dictionary, valid check bits */
+  if ((p[0] & 0x0F) != 8 || (p[1] & 0x20) || ((p[0] << 8) | p[1]) % 31)
+    return SINFL_ERR_DATA;
+
+  n = _inflate((unsigned char *)out, cap, p + 2, size - 2, &used);
+  if (n < 0) return n;
+  if (size - 2 - used < 4) return SINFL_ERR_DATA;
+  if (_load_be32(p + 2 + used) != deflate_adler32(1, out, n))
+    return SINFL_ERR_DATA;
+  return n;
+}
+
+/* length of the gzip member header, SINFL_ERR_DATA if it is invalid */
+static int _gzip_header(const unsigned char *p,
+                        const int size)
+{
+  int flg, n = 10;
+
+  if (size < 18 || p[0] != 0x1F || p[1] != 0x8B || p[2] != 8)
+    return SINFL_ERR_DATA;
+  flg = p[3];
+  if (flg & 0x04) {  /* FEXTRA */
+    if (n + 2 > size) return SINFL_ERR_DATA;
+    n += 2 + (p[n] | (p[n + 1] << 8));
+  }
+  if (flg & 0x08) {  /* FNAME */
+    while (n < size && p[n]) n++;
+    n++;
+  }
+  if (flg & 0x10) {  /* FCOMMENT */
+    while (n < size && p[n]) n++;
+    n++;
+  }
+  if (flg & 0x02) n += 2;  /* FHCRC */
+  if (n + 8 > size) return SINFL_ERR_DATA;
+  return n;
+}
+
+int gzinflate(void *out,
+              const int cap,
+              const void *in,
+              const int size)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  int n, hdr, used;
+
+  hdr = _gzip_header(p, size);
+  if (hdr < 0) return hdr;
+
+  n = _inflate((unsigned char *)out, cap, p + hdr, size - hdr, &used);
+  if (n < 0) return n;
+  p += hdr + used;
+  if (size - hdr - used < 8) return SINFL_ERR_DATA;
+  if (_load_le32(p) != inflate_crc32(0, out, n) ||
+      _load_le32(p + 4) != (unsigned)n)
+    return SINFL_ERR_DATA;
+  return n;
+}
+
+long gzip_size(const void *in,
+               const int size)
+{
+  const unsigned char *p = (const unsigned char *)in;
+  if (_gzip_header(p, size) < 0) return -1;
+  return (long)_load_le32(p + size - 4);
+}
+
+/* slice-by-8 crc32 (gzip polynomial) */
+static unsigned crc_tbl[8][256];
+
+__attribute__((constructor))
+static void _crc_init(void)
+{
+  unsigned i, k, c;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crc_tbl[0][i] = c;
+  }
+  for (i = 0; i < 256; i++)
+    for (k = 1; k < 8; k++)
+      crc_tbl[k][i] = (crc_tbl[k - 1][i] >> 8) ^
+                      crc_tbl[0][crc_tbl[k - 1][i] & 0xFF];
+}
+
+unsigned inflate_crc32(unsigned crc,
+                       const void *in,
+                       int n)
+{
+  const unsigned char *p = (const unsigned char *)in;
+
+  crc = ~crc;
+  while (n >= 8) {
+    unsigned a = _load_le32(p) ^ crc;
+    unsigned b = _load_le32(p + 4);
+    crc = crc_tbl[7][a & 0xFF] ^ crc_tbl[6][(a >> 8) & 0xFF] ^
+          crc_tbl[5][(a >> 16) & 0xFF] ^ crc_tbl[4][a >> 24] ^
+          crc_tbl[3][b & 0xFF] ^ crc_tbl[2][(b >> 8) & 0xFF] ^
+          crc_tbl[1][(b >> 16) & 0xFF] ^ crc_tbl[0][b >> 24];
+    p += 8;
+    n -= 8;
+  }
+  while (n--)
+    crc = crc_tbl[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#ifndef _INFLATE_H_
+#define _INFLATE_H_
+
+
+#define SINFL_ERR_DATA  -1   /* corrupted or truncated stream */
+#define SINFL_ERR_SPACE -2   /* the output buffer is too small */
+
+
+/*
+ * decompress a raw deflate stream into out (cap bytes at most),
+ * returns the decompressed size or a SINFL_ERR_xxx code
+ */
+int inflate(void *out,
+            const int cap,
+            const void *in,
+            const int size);
+
+/* zlib wrapped stream (RFC 1950), the adler32 checksum is verified */
+int zinflate(void *out,
+             const int cap,
+             const void *in,
+             const int size);
+
+/* gzip member (RFC 1952), the crc32 and the size are verified */
+int gzinflate(void *out,
+              const int cap,
+              const void *in,
+              const int size);
+
+/* decompressed size recorded in a gzip trailer, -1 if it is no gzip */
+long gzip_size(const void *in,
+               const int size);
+
+unsigned inflate_crc32(unsigned crc,
+                       const void *in,
+                       int n);
+
+
+#endif
@@ -20,55 +20,56 @@
 
 
 #define CHUNK_SIZE 1024
-#define BUF_MAX_SIZE 8192
+#define READ_MAX_SIZE 262144  /* a task reads no more, the rest waits for the
+                                 next event, rearming reports it at once */
 
 
+/*
+ * what the socket has at hand, NUL terminated past *len; rc = 1 with the
+ * bytes, 0 once the client has closed, -1 if nothing could be read
+ */
 unsigned char *io_socket_read(const int sockfd,
+                              int *len,
                               int *rc)
 {
   int n;
-  unsigned char buf[CHUNK_SIZE];
-  unsigned char workbuf[BUF_MAX_SIZE];
-  unsigned char *last;
-  int last_sz;
-
-  unsigned char *bytes = NULL;
-
-  workbuf[0] = '\0';
-  last = workbuf;
-  last_sz = 0;
+  int size = CHUNK_SIZE * 8;
+  int last_sz = 0;
+  unsigned char *bytes = malloc(size + 1);
 
   /* use loop to read as much as possible in a task */
   do {
-    n = recv(sockfd, buf, CHUNK_SIZE, 0);
+    if (size - last_sz < CHUNK_SIZE) {
+      size *= 2;
+      bytes = realloc(bytes, size + 1);
+    }
+    n = recv(sockfd, bytes + last_sz, CHUNK_SIZE, 0);
 
     /* the client close the socket: EOF reached */
     if (n == 0) {
+      free(bytes);
       *rc = 0;
       return NULL;
     }
     if (n == -1) {
       /* perror("[IO] read()"); */
-      /* normally errno = EAGAIN (Resource busy) */
+      /* normally errno = EAGAIN (Resource busy), the bytes so far are it */
+      if (last_sz && errno == EAGAIN) break;
+      free(bytes);
       *rc = -1;
       return NULL;
     }
-
-    memcpy_fast(last, buf, n);
-    last += n;
     last_sz += n;
 
-    if (n < CHUNK_SIZE) {
-      *last = '\0';
-      last_sz++;
-      bytes = malloc(last_sz);
-      memcpy_fast(bytes, workbuf, last_sz);
-      *rc = 1;
-      return bytes;
-    }
+    if (n < CHUNK_SIZE || last_sz >= READ_MAX_SIZE) break;
 
     nsleep(10);
   } while (1);
+
+  bytes[last_sz] = '\0';
+  *len = last_sz;  /* the body may be binary, so keep the size */
+  *rc = 1;
+  return bytes;
 }
 
 void io_socket_write(const int sockfd,
@@ -157,10 +158,10 @@ char *io_fgetc(FILE *f,
 }
 
 void io_send_chunk(const int clifd,
-                   const char *chunk)
+                   const char *chunk,
+                   const int len_chunk)
 {
   unsigned char hex_len[16];
-  int len_chunk = strlen(chunk);
   int len = itos(hex_len, len_chunk, 16, ' ');
   /* chunked length in Hex */
   D_PRINT("[IO] Sending chunked length... %d\n", clifd);
@@ -9,6 +9,7 @@
 
 
 unsigned char *io_socket_read(const int sockfd,
+                              int *len,
                               int *rc);
 
 void io_socket_write(const int sockfd,
@@ -25,7 +26,8 @@ char *io_fgetc(FILE *fpipe,
                int *len);
 
 void io_send_chunk(const int clifd,
-                   const char *chunk);
+                   const char *chunk,
+                   const int len_chunk);
 
 
 #endif
@@ -12,9 +12,158 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <emmintrin.h>
+#include "arena.h"
 #include "jsmn.h"
 
 
+#define JSMN_EVEN_BITS 0x5555555555555555ULL
+
+
+/* the bytes of 64 set in m, as bits */
+static inline uint64_t _mask64(const __m128i m[4])
+{
+  return (uint64_t)_mm_movemask_epi8(m[0]) |
+         (uint64_t)_mm_movemask_epi8(m[1]) << 16 |
+         (uint64_t)_mm_movemask_epi8(m[2]) << 32 |
+         (uint64_t)_mm_movemask_epi8(m[3]) << 48;
+}
+
+/*
+ * The bytes which follow an odd run of backslashes. The runs which start
+ * on an odd bit are added to the backslashes, the carry ripples through
+ * each run and its end tells whether it was odd.
+ */
+static uint64_t _escaped(uint64_t bs,
+                         unsigned long long *carry)
+{
+  uint64_t odd_starts, even_starts, escaped;
+
+  bs &= ~*carry;
+  uint64_t follows = bs << 1 | *carry;
+  odd_starts = bs & ~JSMN_EVEN_BITS & ~follows;
+  *carry = __builtin_add_overflow(odd_starts, bs, &even_starts);
+  escaped = (JSMN_EVEN_BITS ^ (even_starts << 1)) & follows;
+  return escaped;
+}
+
+/* every bit becomes the xor of itself and the ones below it */
+static uint64_t _prefix_xor(uint64_t x)
+{
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+/* the brackets of the block at sc->block, from the state before it */
+static void _scan_block(jsmnscan_t *sc)
+{
+  const char *p = sc->js + sc->block;
+  char pad[64];
+  __m128i q[4], b[4], n[4];
+  int i;
+
+  /* the last block is cut off, spaces make nothing of the rest */
+  if (sc->len - sc->block < 64) {
+    memset(pad, ' ', 64);
+    memcpy(pad, p, sc->len - sc->block);
+    p = pad;
+  }
+  /* a class of bytes is one movemask each 16 of them */
+  for (i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p + i);
+    /* '[' and ']' are '{' and '}' but for the 0x20 bit */
+    __m128i u = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    q[i] = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+    b[i] = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+    n[i] = _mm_or_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('{')),
+                        _mm_cmpeq_epi8(u, _mm_set1_epi8('}')));
+  }
+
+  sc->next_escaped = sc->escaped;
+  uint64_t quote = _mask64(q) & ~_escaped(_mask64(b), &sc->next_escaped);
+
+  /* from an opening quote up to its closing one */
+  uint64_t in_string = _prefix_xor(quote) ^ sc->in_string;
+  sc->next_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+  sc->nest = _mask64(n) & ~in_string;
+}
+
+void jsmn_scan_init(jsmnscan_t *sc,
+                    const char *js,
+                    const size_t len)
+{
+  sc->js = js;
+  sc->len = len;
+  sc->block = 0;
+  sc->escaped = 0;
+  sc->in_string = 0;
+  _scan_block(sc);
+}
+
+void jsmn_scan_more(jsmnscan_t *sc,
+                    const char *js,
+                    const size_t len)
+{
+  sc->js = js;
+  sc->len = len;
+  _scan_block(sc);
+}
+
+size_t jsmn_scan_nest(jsmnscan_t *sc,
+                      const size_t from)
+{
+  size_t at = from;
+  uint64_t bits;
+
+  for (;;) {
+    if (at < sc->block) at = sc->block;
+    if (at - sc->block < 64) {
+      bits = sc->nest & ~0ULL << (at - sc->block);
+      if (bits) return sc->block + __builtin_ctzll(bits);
+    }
+    /* the block is the last one so far */
+    if (sc->block + 64 >= sc->len) return sc->len;
+
+    /* on to the next, which takes over the state this one left */
+    sc->block += 64;
+    sc->escaped = sc->next_escaped;
+    sc->in_string = sc->next_in_string;
+    _scan_block(sc);
+  }
+}
+
+/*
+ * The first quote, backslash or NUL at or after pos, len if there is
+ * none; the rest of a string is passed over 16 bytes at a time.
+ */
+static size_t _string_stop(const char *js,
+                           size_t pos,
+                           const size_t len)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bs = _mm_set1_epi8('\\');
+  const __m128i nul = _mm_setzero_si128();
+
+  for (; pos + 16 <= len; pos += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(js + pos));
+    int m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+                _mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)),
+                _mm_cmpeq_epi8(v, nul)));
+    if (m) return pos + __builtin_ctz(m);
+  }
+  while (pos < len && js[pos] != '"' && js[pos] != '\\' && js[pos] != '\0')
+    pos++;
+  return pos;
+}
+
+
 /*
  * Allocates a fresh unused token from the token pool.
  */
@@ -123,10 +272,10 @@ static int _parse_string(jsmn_parser_t *parser,
 
   int start = parser->pos;
 
-  parser->pos++;
-
-  /* Skip starting quote */
-  for (; parser->pos < len && js[parser->pos] != '\0'; parser->pos++) {
+  /* Skip starting quote, then whatever can't end the string */
+  for (parser->pos = _string_stop(js, parser->pos + 1, len);
+       parser->pos < len && js[parser->pos] != '\0';
+       parser->pos = _string_stop(js, parser->pos + 1, len)) {
     char c = js[parser->pos];
 
     /* Quote: end of string */
@@ -382,6 +531,31 @@ int jsmn_parse(jsmn_parser_t *parser,
   return count;
 }
 
+/*
+ * The parser stops with JSMN_ERROR_NOMEM before it takes the token it has
+ * no room for, so it picks up where it was once the array is larger.
+ */
+int jsmn_parse_grow(jsmn_parser_t *parser,
+                    const char *js,
+                    const size_t len,
+                    struct _arena *arena,
+                    jsmntok_t **tokens)
+{
+  unsigned int num = MAX_JSMN_TOKENS;
+  jsmntok_t *toks = arena_alloc(arena, num * sizeof(jsmntok_t));
+  int r = JSMN_ERROR_NOMEM;
+
+  while (toks) {
+    r = jsmn_parse(parser, js, len, toks, num);
+    if (r != JSMN_ERROR_NOMEM) break;
+    toks = arena_realloc(arena, toks, num * sizeof(jsmntok_t),
+                         2 * num * sizeof(jsmntok_t));
+    num *= 2;
+  }
+  *tokens = toks;
+  return toks ? r : JSMN_ERROR_NOMEM;
+}
+
 /*
  * Creates a new parser based over a given buffer with an array of tokens
  * available.
@@ -12,7 +12,7 @@
 #define _JSMN_H_
 
 
-#define MAX_JSMN_TOKENS 128
+#define MAX_JSMN_TOKENS 128  /* tokens to start with, see jsmn_parse_grow() */
 
 /**
  * JSON type identifier. Basic types are:
@@ -56,6 +56,28 @@ struct _jsmntok {
 #endif
 };
 
+/*
+ * The brackets outside the strings of a JSON text, found 64 bytes at a
+ * time with SSE2: the quotes which aren't escaped tell where the strings
+ * are, a bracket inside one doesn't count. Whoever only follows the
+ * nesting jumps from bracket to bracket. It is read front to back, and
+ * the text may grow in between (see jsmn_scan_more()).
+ */
+typedef struct _jsmnscan jsmnscan_t;
+
+struct _jsmnscan {
+  const char *js;
+  size_t len;
+  size_t block;                 /* offset of the block in nest */
+  unsigned long long nest;      /* its brackets */
+  /* the state left by the blocks before it */
+  unsigned long long escaped;   /* its first byte follows a backslash */
+  unsigned long long in_string; /* all ones inside a string */
+  /* and by the block itself */
+  unsigned long long next_escaped;
+  unsigned long long next_in_string;
+};
+
 typedef struct _jsmn_parser jsmn_parser_t;
 
 /*
@@ -80,6 +102,38 @@ int jsmn_parse(jsmn_parser_t *parser,
                jsmntok_t *tokens,
                const unsigned int num_tokens);
 
+/*
+ * Run JSON parser over tokens taken from an arena, the array is doubled
+ * whenever it runs out, *tokens is where it ends up.
+ */
+int jsmn_parse_grow(jsmn_parser_t *parser,
+                    const char *js,
+                    const size_t len,
+                    struct _arena *arena,
+                    jsmntok_t **tokens);
+
+
+/*
+ * The index of js, which starts outside any string.
+ */
+void jsmn_scan_init(jsmnscan_t *sc,
+                    const char *js,
+                    const size_t len);
+
+/*
+ * The same text, longer and maybe moved, the index goes on from where it
+ * was; the block cut off by the old end is looked at again.
+ */
+void jsmn_scan_more(jsmnscan_t *sc,
+                    const char *js,
+                    const size_t len);
+
+/*
+ * The first bracket outside the strings at or after from, len if there
+ * is none; from never goes back.
+ */
+size_t jsmn_scan_nest(jsmnscan_t *sc,
+                      const size_t from);
 
 /*
  * Create JSON parser over an array of tokens
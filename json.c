@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <emmintrin.h>
+#include "json.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+static const char _digits[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* make room for n more bytes */
+static void _grow(jsonbuf_t *jb,
+                  const int n)
+{
+  if (jb->len + n <= jb->cap) return;
+  while (jb->len + n > jb->cap) jb->cap *= 2;
+  jb->buf = realloc(jb->buf, jb->cap);
+}
+
+void json_init(jsonbuf_t *jb,
+               const int cap)
+{
+  jb->cap = cap > 16 ? cap : 16;
+  jb->buf = malloc(jb->cap);
+  jb->len = 0;
+}
+
+void json_free(jsonbuf_t *jb)
+{
+  free(jb->buf);
+  jb->buf = NULL;
+  jb->len = jb->cap = 0;
+}
+
+void json_put(jsonbuf_t *jb,
+              const char *s,
+              const int n)
+{
+  _grow(jb, n);
+  memcpy(jb->buf + jb->len, s, n);
+  jb->len += n;
+}
+
+void json_puts(jsonbuf_t *jb,
+               const char *s)
+{
+  json_put(jb, s, strlen(s));
+}
+
+/* the escape of a quote, a backslash or a control character */
+static int _escape(char *out,
+                   const unsigned char c)
+{
+  out[0] = '\\';
+  switch (c) {
+    case '"': out[1] = '"'; return 2;
+    case '\\': out[1] = '\\'; return 2;
+    case '\b': out[1] = 'b'; return 2;
+    case '\f': out[1] = 'f'; return 2;
+    case '\n': out[1] = 'n'; return 2;
+    case '\r': out[1] = 'r'; return 2;
+    case '\t': out[1] = 't'; return 2;
+  }
+  out[1] = 'u';
+  out[2] = '0';
+  out[3] = '0';
+  out[4] = "0123456789abcdef"[c >> 4];
+  out[5] = "0123456789abcdef"[c & 15];
+  return 6;
+}
+
+/*
+ * a json string of s; 16 bytes are checked at a time for the characters
+ * which need an escape, and copied as they are if there is none
+ */
+void json_put_str(jsonbuf_t *jb,
+                  const char *s,
+                  const int n)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  const __m128i ctrl = _mm_set1_epi8(0x1f);
+  int i = 0;
+
+  /* the worst case is 6 bytes for each one, and the quotes */
+  _grow(jb, n * 6 + 2);
+  char *out = jb->buf + jb->len;
+  *out++ = '"';
+
+  while (i < n) {
+    if (i + 16 <= n) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+      __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, quote),
+                               _mm_cmpeq_epi8(x, bslash));
+      /* unsigned x <= 0x1f */
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(x, ctrl), ctrl));
+      int mask = _mm_movemask_epi8(m);
+
+      _mm_storeu_si128((__m128i *)out, x);
+      if (!mask) {
+        out += 16;
+        i += 16;
+        continue;
+      }
+      /* the clean bytes are in place, escape the first special one */
+      int k = __builtin_ctz(mask);
+      out += k;
+      i += k;
+    }
+    else {
+      unsigned char c = s[i];
+      if (c != '"' && c != '\\' && c >= 0x20) {
+        *out++ = c;
+        i++;
+        continue;
+      }
+    }
+    out += _escape(out, s[i++]);
+  }
+
+  *out++ = '"';
+  jb->len = out - jb->buf;
+}
+
+/* an integer, zero padded to width digits */
+void json_put_long(jsonbuf_t *jb,
+                   const long v,
+                   const int width)
+{
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+  while (u >= 100) {
+    p -= 2;
+    memcpy(p, _digits + (u % 100) * 2, 2);
+    u /= 100;
+  }
+  if (u >= 10) {
+    p -= 2;
+    memcpy(p, _digits + u * 2, 2);
+  }
+  else
+    *--p = '0' + u;
+
+  while (tmp + sizeof(tmp) - p < width) *--p = '0';
+  if (v < 0) *--p = '-';
+
+  json_put(jb, p, tmp + sizeof(tmp) - p);
+}
+
+/* json has no NaN, they are strings as postgresql prints them */
+static int _put_special(jsonbuf_t *jb,
+                        const double v)
+{
+  if (isnan(v)) {
+    json_puts(jb, "\"NaN\"");
+    return 1;
+  }
+  if (isinf(v)) {
+    json_puts(jb, v > 0 ? "\"Infinity\"" : "\"-Infinity\"");
+    return 1;
+  }
+  return 0;
+}
+
+/* the shortest decimal which reads back as v */
+void json_put_double(jsonbuf_t *jb,
+                     const double v)
+{
+  char tmp[32];
+  int n;
+
+  if (_put_special(jb, v)) return;
+
+  int prec;
+  for (prec = 15; prec < 17; prec++) {
+    n = snprintf(tmp, sizeof(tmp), "%.*g", prec, v);
+    if (strtod(tmp, NULL) == v) break;
+  }
+  if (prec == 17) n = snprintf(tmp, sizeof(tmp), "%.17g", v);
+  json_put(jb, tmp, n);
+}
+
+/*
+ * the same for a float4, the shortest which reads back as a float, as
+ * the text format has it: 0.1, not 0.100000001
+ */
+void json_put_float(jsonbuf_t *jb,
+                    const float v)
+{
+  char tmp[32];
+  int n;
+
+  if (_put_special(jb, v)) return;
+
+  int prec;
+  for (prec = 1; prec < FLT_DIG + 3; prec++) {
+    n = snprintf(tmp, sizeof(tmp), "%.*g", prec, v);
+    if (strtof(tmp, NULL) == v) break;
+  }
+  if (prec == FLT_DIG + 3) n = snprintf(tmp, sizeof(tmp), "%.9g", v);
+  json_put(jb, tmp, n);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#ifndef _JSON_H_
+#define _JSON_H_
+
+
+typedef struct _jsonbuf jsonbuf_t;
+
+struct _jsonbuf {
+  char *buf;
+  int len;
+  int cap;
+};
+
+
+void json_init(jsonbuf_t *jb,
+               const int cap);
+
+void json_free(jsonbuf_t *jb);
+
+void json_put(jsonbuf_t *jb,
+              const char *s,
+              const int n);
+
+void json_puts(jsonbuf_t *jb,
+               const char *s);
+
+void json_put_str(jsonbuf_t *jb,
+                  const char *s,
+                  const int n);
+
+void json_put_long(jsonbuf_t *jb,
+                   const long v,
+                   const int width);
+
+void json_put_double(jsonbuf_t *jb,
+                     const double v);
+
+void json_put_float(jsonbuf_t *jb,
+                    const float v);
+
+
+#endif
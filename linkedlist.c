@@ -12,16 +12,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include "slab.h"
 #include "linkedlist.h"
 
 //#define DEBUG
 #include "debug.h"
 
 
-static node_t *_node_new(void *data,
+static node_t *_node_new(list_t *list,
+                         void *data,
                          const long stamp)
 {
-  node_t *n = malloc(sizeof(struct _node));
+  node_t *n = slab_alloc(list->nodes);
   if (!n) return NULL;
 
   n->data = data;
@@ -37,6 +40,12 @@ list_t *list_new()
 
   list->head = NULL;
   list->current = NULL;
+  list->nodes = slab_new(sizeof(struct _node));
+  if (!list->nodes) {
+    free(list);
+    return NULL;
+  }
+  pthread_rwlock_init(&list->lock, NULL);
   return list;
 }
 
@@ -46,14 +55,14 @@ static void _add(list_t *list,
 {
   node_t *current = NULL;
   if (list->head == NULL) {
-    list->head = _node_new(data, stamp);
+    list->head = _node_new(list, data, stamp);
   }
   else {
     current = list->head;
     while (current->next != NULL) {
       current = current->next;
     }
-    current->next = _node_new(data, stamp);
+    current->next = _node_new(list, data, stamp);
   }
 }
 
@@ -84,7 +93,25 @@ void list_del(list_t *list,
     if (current->stamp == stamp) {
       previous->next = current->next;
       if (current == list->head) list->head = current->next;
-      free(current);
+      slab_free(list->nodes, current);
+      return;
+    }
+    previous = current;
+    current = current->next;
+  }
+}
+
+/* the node of data, two nodes may have the same stamp */
+void list_remove(list_t *list,
+                 const void *data)
+{
+  node_t *current = list->head;
+  node_t *previous = current;
+  while (current != NULL) {
+    if (current->data == data) {
+      previous->next = current->next;
+      if (current == list->head) list->head = current->next;
+      slab_free(list->nodes, current);
       return;
     }
     previous = current;
@@ -160,15 +187,11 @@ void list_display(list_t *list)
   }
 }
 
+/* the nodes go with their pool */
 void list_destroy(list_t *list)
 {
-  node_t *current = list->head;
-  node_t *next = current;
-  while (current != NULL) {
-    next = current->next;
-    free(current);
-    current = next;
-  }
+  slab_destroy(list->nodes);
+  pthread_rwlock_destroy(&list->lock);
   free(list);
 }
 
@@ -26,6 +26,8 @@ typedef struct _list list_t;
 struct _list {
   struct _node *head;
   struct _node *current;
+  struct _slab *nodes;  /* the pool of its nodes */
+  pthread_rwlock_t lock;  /* for the users of a list shared by threads */
 };
 
 
@@ -38,6 +40,9 @@ void list_update(list_t *list,
 void list_del(list_t *list,
               const long stamp);
 
+void list_remove(list_t *list,
+                 const void *data);
+
 void list_reverse(list_t *list);
 
 void list_sort(list_t *list,
@@ -18,12 +18,25 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <libpq-fe.h>
+#include "json.h"
 #include "pg_conn.h"
+#include "sqlobj.h"
+#include "sqlops.h"
+#include "sqlcache.h"
+#include "sqlwrite.h"
+#include "snapshot.h"
+#include "backend.h"
 #include "util.h"
+#include "arena.h"
+#include "slab.h"
 #include "linkedlist.h"
 #include "thpool.h"
+#include "http_msg.h"
 #include "http_cache.h"
 #include "http_conn.h"
+#include "http_post.h"
+#include "zpolicy.h"
+#include "flight.h"
 
 #define DEBUG
 #include "debug.h"
@@ -36,10 +49,16 @@
 #define HTTP_KEEPALIVE_TIME 72000  /* 72 seconds */
 #define PORT 9000
 
+#define PG_CONNS_MIN 2             /* connections kept open */
+#define PG_CONNS_MAX 32            /* connections opened under load */
+#define SNAPSHOT_TABLES "users"    /* read-mostly tables kept in memory */
+
 #define MAX_CACHE_TIME 86400000    /* 24 x 60 x 60 = 1 day */
+#define CACHE_COLD_TIME 300000     /* 5 minutes, then keep compressed only */
 
 
 static volatile int svc_running = 1;
+static volatile int lsn_opening = 0;  /* a worker reopens the listener */
 
 
 static void _svc_stopper(int dummy)
@@ -58,19 +77,24 @@ static void _set_nonblocking(const int fd)
     perror("fcntl()");
 }
 
+/* the connections closed, or idle for timeout, go once no one holds them */
 static void _expire_timers(list_t *timers,
-                           const long timeout)
+                           const long timeout,
+                           thpool_t *taskpool)
 {
   node_t *timer = list_first(timers);
   if (timer) {
     long cur_time = mstime();
     do {
-      if (cur_time - timer->stamp >= timeout) {
-        httpconn_t *conn = (httpconn_t *)timer->data;
-        httpconn_destroy(conn);
-
-        list_del(timers, timer->stamp);
+      httpconn_t *conn = (httpconn_t *)timer->data;
+      /* a query in flight still owns the connection */
+      if (conn->state == CONN_ACTIVE && conn->sqlreq)
+        http_post_check(conn, cur_time, taskpool);
+      if (httpconn_expired(conn, cur_time, timeout)) {
+        /* the node goes back to the pool, step over it first */
         timer = list_next(timers);
+        list_remove(timers, conn);
+        httpconn_destroy(conn);
       }
       else
         timer = list_next(timers);
@@ -78,32 +102,40 @@ static void _expire_timers(list_t *timers,
   }
 }
 
-static void _expire_cache(list_t *cache,
-                          const long timeout)
+/* (re)open the connection which keeps the query result cache fresh */
+static void _listen_changes(sqlcache_t *sqlcache,
+                            httpconn_t *lsnconn)
 {
-  node_t *node = list_first(cache);
-  if (node) {
-    long cur_time = mstime();
-    do {
-      if (cur_time - node->stamp >= timeout) {
-        cache_data_t *data = (cache_data_t *)node->data;
-        http_cache_data_destroy(data);
-        D_PRINT("[CACHE] cached data expired!\n");
+  int fd = sqlcache_listen(sqlcache, "dbname = demo", "identity");
+  if (fd == -1) return;
 
-        list_del(cache, node->stamp);
-        node = list_next(cache);
-      }
-      else
-        node = list_next(cache);
-    } while (node);
-  }
+  /* level-triggered, the notifications are read on the main thread */
+  struct epoll_event event;
+  event.data.ptr = (void *)lsnconn;
+  event.events = EPOLLIN;
+  lsnconn->sockfd = fd;
+  if (epoll_ctl(lsnconn->epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+    perror("epoll_ctl()");
+}
+
+/* the connect blocks while the database is down, not on the event loop */
+static void _listen_task(void *arg)
+{
+  httpconn_t *lsnconn = (httpconn_t *)arg;
+  _listen_changes(lsnconn->sqlcache, lsnconn);
+  lsn_opening = 0;
 }
 
 static void _receive_conn(const int srvfd,
                           const int epfd,
-                          PGconn *pgconn,
+                          backend_t *backend,
+                          sqlcache_t *sqlcache,
+                          sqlwriter_t *writer,
+                          snapshot_t *snapshot,
+                          flights_t *flights,
                           list_t *cache,
-                          list_t *timers)
+                          list_t *timers,
+                          slab_t *conns)
 {
   struct sockaddr cliaddr;
   socklen_t len_cliaddr = sizeof(struct sockaddr);
@@ -127,7 +159,13 @@ static void _receive_conn(const int srvfd,
     D_PRINT("[CONN] client %s connected on socket %d\n", cli_ip, clifd);
 
     _set_nonblocking(clifd);
-    httpconn_t *cliconn = httpconn_new(clifd, epfd, pgconn, cache, timers);
+    httpconn_t *cliconn = httpconn_new(clifd, epfd, backend, sqlcache,
+                                       writer, snapshot, flights,
+                                       cache, timers, conns);
+    if (!cliconn) {
+      close(clifd);
+      continue;
+    }
 
     /* register timers */
     long cur_time = mstime();
@@ -194,8 +232,42 @@ static int _listen(const int srvfd)
 
 int main(int argc, char **argv)
 {
-  /* create a postgresql db connection */
-  PGconn *pgconn = pg_connect("dbname = demo", "identity");
+  backend_t *backend;
+  pgpool_t *pgpool = NULL;
+  sqlcache_t *sqlcache = NULL;
+  sqlwriter_t *writer = NULL;
+  snapshot_t *snapshot = NULL;
+
+  /* detect number of cpu cores and use it for thread pool */
+  int np = get_nprocs();
+  thpool_t *taskpool = thpool_init(np * THREADS_PER_CORE);
+
+  /* the tables of a fixture file, to benchmark without a database */
+  char *spec = getenv(BACKEND_ENV);
+  if (spec && strncmp(spec, "mock:", 5) == 0) {
+    backend = backend_mock(spec + 5);
+    if (!backend) return 1;
+  }
+  else {
+    /* create a pool of postgresql db connections */
+    pgpool = pg_pool_new("dbname = demo", "identity",
+                         PG_CONNS_MIN, PG_CONNS_MAX);
+    if (!pgpool) return 1;
+    backend = backend_pg(pgpool);
+    /* results of the SELECTs, dropped when the tables change */
+    sqlcache = sqlcache_new();
+    /* the INSERTs, UPDATEs and DELETEs, committed in groups */
+    writer = sqlwriter_new(pgpool, taskpool);
+    if (!writer) return 1;
+    /* the small hot tables, reloaded whenever the cache hears of a change */
+    snapshot = snapshot_new(pgpool, SNAPSHOT_TABLES);
+    if (!snapshot) return 1;
+    sqlcache->changed = snapshot_changed;
+    sqlcache->changed_arg = snapshot;
+  }
+  D_PRINT("[DB] %s backend\n", backend->name);
+  /* identical requests in progress, they share the work */
+  flights_t *flights = flights_new();
 
   /*
    * install signal handle for SIGPIPE
@@ -214,13 +286,12 @@ int main(int argc, char **argv)
   /* ctrl-c handler */
   signal(SIGINT, _svc_stopper);
 
-  /* detect number of cpu cores and use it for thread pool */
-  int np = get_nprocs();
-  thpool_t *taskpool = thpool_init(np * THREADS_PER_CORE);
   /* list of files cached in the memory */
   list_t *cache = list_new();
   /* list of timers */
   list_t *timers = list_new();
+  /* the connections, recycled from slabs rather than malloc */
+  slab_t *conns = slab_new(sizeof(struct _httpconn));
   /* loop time */
   long loop_time = mstime();
 
@@ -248,7 +319,8 @@ int main(int argc, char **argv)
   /* mark the server socket for reading, and become edge-triggered */
   struct epoll_event event;
   memset(&event, 0, sizeof(struct epoll_event));
-  httpconn_t *srvconn = httpconn_new(srvfd, epfd, NULL, NULL, NULL);
+  httpconn_t *srvconn = httpconn_new(srvfd, epfd, NULL, NULL, NULL,
+                                     NULL, NULL, NULL, NULL, conns);
   event.data.ptr = (void *)srvconn;
   event.events = EPOLLIN | EPOLLET;
   if (epoll_ctl(epfd, EPOLL_CTL_ADD, srvfd, &event) == -1) {
@@ -256,6 +328,11 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  /* the LISTEN connection, until it is up the cache only has the ttl */
+  httpconn_t *lsnconn = httpconn_new(-1, epfd, NULL, sqlcache, NULL,
+                                     NULL, NULL, NULL, NULL, conns);
+  if (sqlcache) _listen_changes(sqlcache, lsnconn);
+
   struct epoll_event *events = calloc(MAXEVENTS, sizeof(struct epoll_event));
 
   do {
@@ -265,22 +342,14 @@ int main(int argc, char **argv)
       perror("epoll_wait()");
     }
 
-    if ((mstime() - loop_time) >= EPOLL_TIMEOUT) {
-      /* expire the timers */
-      _expire_timers(timers, HTTP_KEEPALIVE_TIME);
-      /* expire the cache */
-      _expire_cache(cache, MAX_CACHE_TIME);
-
-      loop_time = mstime();
-    }
-
-    /* loop through events */
+    /* loop through events, none on a timeout: the old ones may be freed */
     int i = 0;
-    do {
+    while (i < nevents) {
       httpconn_t *conn = (httpconn_t *)events[i].data.ptr;
 
-      /* error case */
-      if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) {
+      /* error case, a client or the listener gone is told by its read */
+      if (((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) &&
+          conn->sockfd == srvfd) {
         if (errno == EAGAIN)
           nsleep(10);
         else {
@@ -289,19 +358,49 @@ int main(int argc, char **argv)
         }
       }
 
-      if (events[i].events & EPOLLIN) {
+      if (events[i].events & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP)) {
         if (conn->sockfd == srvfd)
-          _receive_conn(srvfd, epfd, pgconn, cache, timers);
+          _receive_conn(srvfd, epfd, backend, sqlcache, writer, snapshot,
+                        flights, cache, timers, conns);
+        else if (conn == lsnconn)
+          sqlcache_notified(sqlcache);
         else {
           /* client socket; read client data and process it */
-          thpool_add_task(taskpool, httpconn_task, conn);
+          if (httpconn_take(conn))
+            thpool_add_task(taskpool, httpconn_task, conn);
         }
       }
 
       i++;
-    } while (i < nevents);
+    }
+
+    /* after the events, a connection freed here is in none of them */
+    if ((mstime() - loop_time) >= EPOLL_TIMEOUT) {
+      /* expire the timers */
+      _expire_timers(timers, HTTP_KEEPALIVE_TIME, taskpool);
+      /* expire the cache */
+      http_cache_expire(cache, MAX_CACHE_TIME);
+      /* cold text entries keep only the compressed bytes */
+      http_cache_cool(cache, CACHE_COLD_TIME);
+      /* trade compression level for cpu */
+      zpolicy_adapt(thpool_qdelay(taskpool), np);
+      if (pgpool) {
+        /* drop the broken and the surplus idle db connections */
+        pg_pool_check(pgpool);
+        /* drop the old query results, reconnect the lost listener */
+        sqlcache_expire(sqlcache);
+        if (!sqlcache->listener && !lsn_opening) {
+          lsn_opening = 1;
+          thpool_add_task(taskpool, _listen_task, lsnconn);
+        }
+      }
+
+      loop_time = mstime();
+    }
   } while (svc_running);
 
+  /* the writes queued are committed, their replies go to the workers */
+  if (writer) sqlwriter_destroy(writer);
   thpool_wait(taskpool);
   /*
    * glibc doesn't free thread stacks when threads exit;
@@ -312,17 +411,33 @@ int main(int argc, char **argv)
    */
   thpool_destroy(taskpool);
 
+  /* the workers are done, every connection left is closed */
+  while (list_first(timers)) {
+    httpconn_t *conn = (httpconn_t *)list_first(timers)->data;
+    list_remove(timers, conn);
+    httpconn_destroy(conn);
+  }
   list_destroy(timers);
-  _expire_cache(cache, 0);
+  http_cache_expire(cache, 0);
   list_destroy(cache);
 
   shutdown(srvfd, SHUT_RDWR);
   close(srvfd);
-  if (srvconn) free(srvconn);
+  /* the connections still open go with their pool */
+  arena_destroy(srvconn->arena);
+  arena_destroy(lsnconn->arena);
+  slab_destroy(conns);
   close(epfd);
   free(events);
 
-  PQfinish(pgconn);
+  if (snapshot) {
+    sqlcache->changed = NULL;
+    snapshot_destroy(snapshot);
+  }
+  flights_destroy(flights);
+  if (sqlcache) sqlcache_destroy(sqlcache);
+  /* the pool goes with its backend */
+  backend_close(backend);
 
   D_PRINT("Exit gracefully...\n");
   return 0;
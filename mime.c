@@ -28,6 +28,7 @@ int mime_set_content_type(char *ctype,
   static const char *js = "text/javascript";
   static const char *html = "text/html; charset=utf-8";
   static const char *txt = "text/plain";
+  static const char *json = "application/json";
   static const char *bin = "application/octet-stream";
 
   /* MIME types - images */
@@ -116,6 +117,13 @@ int mime_set_content_type(char *ctype,
     return MIME_TXT;
   }
 
+  /* MIME type - json */
+  if (strcmp(ext, "json") == 0) {
+    memcpy_fast(ctype, json, 16);
+    ctype[16] = '\0';
+    return MIME_TXT;
+  }
+
   memcpy_fast(ctype, bin, 24);
   ctype[24] = '\0';
   return MIME_BIN;
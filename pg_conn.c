@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <libpq-fe.h>
 #include "util.h"
 #include "pg_conn.h"
@@ -15,14 +16,15 @@
 #include "debug.h"
 
 
-void pg_exit_nicely(PGconn *conn)
-{
-  PQfinish(conn);
-  exit(1);
-}
+#define PG_POOL_SPIN 100000  /* ns, pause between checkout attempts */
+
 
-PGconn *pg_connect(const char *conninfo,
-                   const char *schema)
+/*
+ * a connection with the search path set, NULL on failure; the server
+ * stops a statement running past PG_STMT_TIMEOUT, whoever waits for it
+ */
+PGconn *pg_open(const char *conninfo,
+                const char *schema)
 {
   /* Make a connection to the database */
   PGconn *conn = PQconnectdb(conninfo);
@@ -30,20 +32,26 @@ PGconn *pg_connect(const char *conninfo,
   /* Check to see that the backend connection was successfully made */
   if (PQstatus(conn) != CONNECTION_OK) {
     D_PRINT("[DB] Connection to database failed: %s\n", PQerrorMessage(conn));
-    pg_exit_nicely(conn);
+    PQfinish(conn);
+    return NULL;
   }
 
   /* Set always-secure search path, so malicious users can't take control */
-  char path[64];
+  char path[96];
+  char timeout[16];
+  itos((unsigned char *)timeout, PG_STMT_TIMEOUT, 10, ' ');
   char *ret = strbld(path, "SET search_path=");
   ret = strbld(ret, schema);
+  ret = strbld(ret, "; SET statement_timeout=");
+  ret = strbld(ret, timeout);
   *ret++ = '\0';
 
   PGresult *res = PQexec(conn, path);
   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-    D_PRINT("[DB] SET search_path failed: %s\n", PQerrorMessage(conn));
+    D_PRINT("[DB] %s failed: %s\n", path, PQerrorMessage(conn));
     PQclear(res);
-    pg_exit_nicely(conn);
+    PQfinish(conn);
+    return NULL;
   }
 
   /* PQclear PGresult whenever it is no longer needed to avoid memory leaks */
@@ -51,3 +59,290 @@ PGconn *pg_connect(const char *conninfo,
 
   return conn;
 }
+
+static long _now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* publish a slot owned by the caller, after all its fields are written */
+static void _pg_set(pgslot_t *slot,
+                    const int state)
+{
+  __sync_synchronize();
+  slot->state = state;
+}
+
+/* the statements die with the connection */
+static void _pg_forget(pgslot_t *slot)
+{
+  int i;
+  for (i = 0; i < PG_STMT_MAX; i++) pg_stmt_drop(&slot->stmts[i]);
+}
+
+/* close the connection of a slot which is owned by the caller */
+static void _pg_close(pgslot_t *slot)
+{
+  _pg_forget(slot);
+  PQfinish(slot->conn);
+  slot->conn = NULL;
+  _pg_set(slot, PG_SLOT_EMPTY);
+}
+
+/* a checked out connection must be usable, or it is opened again */
+static int _pg_healthy(pgpool_t *pool,
+                       pgslot_t *slot)
+{
+  if (PQstatus(slot->conn) == CONNECTION_OK) return 1;
+
+  D_PRINT("[DB] broken connection, reconnecting...\n");
+  _pg_forget(slot);
+  PQfinish(slot->conn);
+  slot->conn = pg_open(pool->conninfo, pool->schema);
+  if (slot->conn) return 1;
+
+  _pg_set(slot, PG_SLOT_EMPTY);
+  return 0;
+}
+
+static void _pg_waited(pgpool_t *pool,
+                       const long start)
+{
+  if (!start) return;
+
+  long us = _now_us() - start;
+  long max = pool->maxwait_us;
+  __sync_fetch_and_add(&pool->wait_us, us);
+  while (us > max && !__sync_bool_compare_and_swap(&pool->maxwait_us, max, us))
+    max = pool->maxwait_us;
+}
+
+pgpool_t *pg_pool_new(const char *conninfo,
+                      const char *schema,
+                      const int min,
+                      const int max)
+{
+  int i;
+  pgpool_t *pool = calloc(1, sizeof(struct _pgpool));
+  pool->conninfo = strdup(conninfo);
+  pool->schema = strdup(schema);
+  pool->max = max > PG_POOL_MAX ? PG_POOL_MAX : max;
+  pool->min = min > pool->max ? pool->max : min;
+
+  for (i = 0; i < pool->min; i++) {
+    pgslot_t *slot = &pool->slots[i];
+    slot->conn = pg_open(conninfo, schema);
+    if (!slot->conn) {
+      pg_pool_destroy(pool);
+      return NULL;
+    }
+    slot->last_used = mstime();
+    slot->state = PG_SLOT_IDLE;
+  }
+  D_PRINT("[DB] pool of %d-%d connections\n", pool->min, pool->max);
+
+  return pool;
+}
+
+void pg_pool_destroy(pgpool_t *pool)
+{
+  int i;
+  for (i = 0; i < PG_POOL_MAX; i++) {
+    if (pool->slots[i].conn) _pg_close(&pool->slots[i]);
+  }
+  free(pool->conninfo);
+  free(pool->schema);
+  free(pool);
+}
+
+/*
+ * check out a connection, an idle one is preferred and the pool grows up
+ * to max when there is none, NULL if the database can't be reached or
+ * no connection comes back within wait ms
+ */
+pgslot_t *pg_pool_get(pgpool_t *pool,
+                      const long wait)
+{
+  long start = 0;
+  int i;
+
+  __sync_fetch_and_add(&pool->ncheckouts, 1);
+  do {
+    for (i = 0; i < pool->max; i++) {
+      pgslot_t *slot = &pool->slots[i];
+      if (slot->state == PG_SLOT_IDLE &&
+          __sync_bool_compare_and_swap(&slot->state,
+                                       PG_SLOT_IDLE, PG_SLOT_BUSY)) {
+        if (_pg_healthy(pool, slot)) {
+          _pg_waited(pool, start);
+          return slot;
+        }
+      }
+    }
+
+    for (i = 0; i < pool->max; i++) {
+      pgslot_t *slot = &pool->slots[i];
+      if (slot->state == PG_SLOT_EMPTY &&
+          __sync_bool_compare_and_swap(&slot->state,
+                                       PG_SLOT_EMPTY, PG_SLOT_BUSY)) {
+        slot->conn = pg_open(pool->conninfo, pool->schema);
+        if (!slot->conn) {
+          /* the database is down, don't keep the caller waiting */
+          _pg_set(slot, PG_SLOT_EMPTY);
+          __sync_fetch_and_add(&pool->nfails, 1);
+          return NULL;
+        }
+        D_PRINT("[DB] pool grows, slot %d\n", i);
+        _pg_waited(pool, start);
+        return slot;
+      }
+    }
+
+    /* all the connections are busy */
+    if (!start) {
+      start = _now_us();
+      __sync_fetch_and_add(&pool->nwaits, 1);
+    }
+    else if (_now_us() - start >= wait * 1000L) {
+      _pg_waited(pool, start);
+      __sync_fetch_and_add(&pool->nfails, 1);
+      return NULL;
+    }
+    nsleep(PG_POOL_SPIN);
+  } while (1);
+}
+
+void pg_pool_put(pgpool_t *pool,
+                 pgslot_t *slot)
+{
+  /* broken, or abandoned with a query still in flight or unsent */
+  if (PQstatus(slot->conn) != CONNECTION_OK ||
+      PQtransactionStatus(slot->conn) == PQTRANS_ACTIVE ||
+      (PQisnonblocking(slot->conn) && PQflush(slot->conn) != 0) ||
+      (PQpipelineStatus(slot->conn) != PQ_PIPELINE_OFF &&
+       !PQexitPipelineMode(slot->conn))) {
+    _pg_close(slot);
+    return;
+  }
+
+  /* the other users of the pool block on their queries */
+  PQsetnonblocking(slot->conn, 0);
+
+  /* never hand out a connection in the middle of a transaction */
+  if (PQtransactionStatus(slot->conn) != PQTRANS_IDLE) {
+    PGresult *res = PQexec(slot->conn, "ROLLBACK");
+    PQclear(res);
+  }
+
+  slot->last_used = mstime();
+  _pg_set(slot, PG_SLOT_IDLE);
+}
+
+/*
+ * periodic maintenance: drop the broken idle connections and the ones
+ * idle for PG_POOL_IDLE above the minimum
+ */
+void pg_pool_check(pgpool_t *pool)
+{
+  int i;
+  int nconns = 0;
+  long cur_time = mstime();
+
+  for (i = 0; i < pool->max; i++) {
+    if (pool->slots[i].state != PG_SLOT_EMPTY) nconns++;
+  }
+
+  for (i = 0; i < pool->max; i++) {
+    pgslot_t *slot = &pool->slots[i];
+    if (slot->state != PG_SLOT_IDLE ||
+        !__sync_bool_compare_and_swap(&slot->state,
+                                      PG_SLOT_IDLE, PG_SLOT_BUSY))
+      continue;
+
+    if (PQstatus(slot->conn) != CONNECTION_OK) {
+      D_PRINT("[DB] slot %d broken, closed\n", i);
+      _pg_close(slot);
+      nconns--;
+    }
+    else if (nconns > pool->min && cur_time - slot->last_used >= PG_POOL_IDLE) {
+      D_PRINT("[DB] slot %d idle, closed\n", i);
+      _pg_close(slot);
+      nconns--;
+    }
+    else
+      _pg_set(slot, PG_SLOT_IDLE);
+  }
+
+  D_PRINT("[DB] %d conns, %ld checkouts, %ld waits (%ld us max), %ld fails\n",
+          nconns, pool->ncheckouts, pool->nwaits, pool->maxwait_us,
+          pool->nfails);
+}
+
+/*
+ * ask the server to stop what the connection runs, cancel is freed; it
+ * connects to the server and waits, never on the event loop
+ */
+void pg_cancel(PGcancel *cancel)
+{
+  char err[256];
+  if (!PQcancel(cancel, err, sizeof(err)))
+    D_PRINT("[DB] cancel failed: %s\n", err);
+  PQfreeCancel(cancel);
+}
+
+/* a statement already prepared on the connection of the slot */
+pgstmt_t *pg_stmt_find(pgslot_t *slot,
+                       const char *sql)
+{
+  int i;
+  for (i = 0; i < PG_STMT_MAX; i++) {
+    pgstmt_t *stmt = &slot->stmts[i];
+    if (stmt->sql && strcmp(stmt->sql, sql) == 0) {
+      stmt->used = ++slot->tick;
+      return stmt;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * reserve an entry for a statement about to be prepared, the least
+ * recently used one is replaced when all are taken, and its name is put
+ * in evicted (empty otherwise) to be deallocated first
+ */
+pgstmt_t *pg_stmt_add(pgslot_t *slot,
+                      const char *sql,
+                      char *evicted)
+{
+  int i;
+  pgstmt_t *lru = &slot->stmts[0];
+
+  evicted[0] = '\0';
+  for (i = 0; i < PG_STMT_MAX; i++) {
+    pgstmt_t *stmt = &slot->stmts[i];
+    if (!stmt->sql) {
+      lru = stmt;
+      break;
+    }
+    if (stmt->used < lru->used) lru = stmt;
+  }
+
+  if (lru->sql) {
+    strcpy(evicted, lru->name);
+    pg_stmt_drop(lru);
+  }
+  lru->sql = strdup(sql);
+  sprintf(lru->name, "stmt_%d", slot->seq++);
+  lru->used = ++slot->tick;
+  lru->format = 0;
+
+  return lru;
+}
+
+void pg_stmt_drop(pgstmt_t *stmt)
+{
+  if (stmt->sql) free(stmt->sql);
+  stmt->sql = NULL;
+}
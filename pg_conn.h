@@ -8,10 +8,87 @@
 #define _PG_CONN_H_
 
 
-void pg_exit_nicely(PGconn *conn);
+#define PG_POOL_MAX 64        /* upper bound of the pool size */
+#define PG_POOL_WAIT 2000     /* ms, give up a checkout after this */
+#define PG_POOL_IDLE 60000    /* ms, close idle connections above min */
+#define PG_STMT_MAX 32        /* prepared statements kept per connection */
+#define PG_DEADLINE 5000      /* ms, from a request to the first rows of its
+                                 reply, waiting for a connection included */
+#define PG_STMT_TIMEOUT 60000 /* ms, the server stops a statement after it */
 
-PGconn *pg_connect(const char *conninfo,
-                   const char *schema);
+#define PG_SLOT_EMPTY 0       /* no connection */
+#define PG_SLOT_IDLE 1        /* connected, ready for checkout */
+#define PG_SLOT_BUSY 2        /* checked out, or being opened */
+
+
+typedef struct _pgstmt pgstmt_t;
+
+struct _pgstmt {
+  char *sql;      /* the statement text, NULL if the entry is free */
+  char name[16];
+  long used;      /* lru tick */
+  int format;     /* of the results, binary once the columns allow it */
+};
+
+typedef struct _pgslot pgslot_t;
+
+struct _pgslot {
+  PGconn *conn;
+  volatile int state;
+  long last_used;  /* ms */
+
+  /* statements prepared on this connection, only its owner touches them */
+  pgstmt_t stmts[PG_STMT_MAX];
+  long tick;
+  int seq;         /* for unique statement names */
+};
+
+typedef struct _pgpool pgpool_t;
+
+struct _pgpool {
+  char *conninfo;
+  char *schema;
+  int min;
+  int max;
+  pgslot_t slots[PG_POOL_MAX];
+
+  /* metrics, updated atomically */
+  volatile long ncheckouts;
+  volatile long nwaits;     /* checkouts which found no free connection */
+  volatile long nfails;     /* checkouts which timed out */
+  volatile long wait_us;    /* total time spent waiting */
+  volatile long maxwait_us;
+};
+
+
+PGconn *pg_open(const char *conninfo,
+                const char *schema);
+
+pgpool_t *pg_pool_new(const char *conninfo,
+                      const char *schema,
+                      const int min,
+                      const int max);
+
+void pg_pool_destroy(pgpool_t *pool);
+
+pgslot_t *pg_pool_get(pgpool_t *pool,
+                      const long wait);
+
+void pg_pool_put(pgpool_t *pool,
+                 pgslot_t *slot);
+
+void pg_pool_check(pgpool_t *pool);
+
+void pg_cancel(PGcancel *cancel);
+
+pgstmt_t *pg_stmt_find(pgslot_t *slot,
+                       const char *sql);
+
+pgstmt_t *pg_stmt_add(pgslot_t *slot,
+                      const char *sql,
+                      char *evicted);
+
+void pg_stmt_drop(pgstmt_t *stmt);
 
 
 #endif
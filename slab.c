@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "slab.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+#define SLAB_INDEX 0xffffffffULL
+
+
+/* the objects follow the first line of a slab, which has its number */
+static inline char *_obj(const slab_t *slab,
+                         const unsigned int i)
+{
+  return slab->slabs[i / slab->per] + SLAB_LINE +
+         (size_t)(i % slab->per) * slab->size;
+}
+
+static inline unsigned int _index(const slab_t *slab,
+                                  const void *ptr)
+{
+  char *base = (char *)((uintptr_t)ptr & ~((uintptr_t)SLAB_BYTES - 1));
+  return *(int *)base * slab->per +
+         ((char *)ptr - base - SLAB_LINE) / slab->size;
+}
+
+/* a free object has the index + 1 of the next one in its first bytes */
+static inline unsigned int _link(const void *obj)
+{
+  return *(volatile unsigned int *)obj;
+}
+
+/* the objects from first to last go on the free list at once */
+static void _push(slab_t *slab,
+                  const unsigned int first,
+                  char *last)
+{
+  unsigned long long top;
+  do {
+    top = slab->top;
+    *(volatile unsigned int *)last = top & SLAB_INDEX;
+  } while (!__sync_bool_compare_and_swap(&slab->top, top,
+                                         ((top >> 32) + 1) << 32 |
+                                         (first + 1)));
+}
+
+/* a new slab, unless another thread added one meanwhile */
+static int _grow(slab_t *slab)
+{
+  int i;
+  char *mem;
+
+  pthread_mutex_lock(&slab->lock);
+  if (slab->top & SLAB_INDEX) {
+    pthread_mutex_unlock(&slab->lock);
+    return 1;
+  }
+
+  int no = slab->nslabs;
+  if (no == SLAB_MAX ||
+      posix_memalign((void **)&mem, SLAB_BYTES, SLAB_BYTES)) {
+    pthread_mutex_unlock(&slab->lock);
+    return 0;
+  }
+  *(int *)mem = no;
+  slab->slabs[no] = mem;
+  __sync_synchronize();
+  slab->nslabs = no + 1;
+
+  unsigned int first = no * slab->per;
+  for (i = 0; i < slab->per - 1; i++)
+    *(unsigned int *)_obj(slab, first + i) = first + i + 2;
+  _push(slab, first, _obj(slab, first + slab->per - 1));
+  D_PRINT("[SLAB] slab %d of %lu-byte objects, %ld in use\n",
+          no, slab->size, slab->nused);
+
+  pthread_mutex_unlock(&slab->lock);
+  return 1;
+}
+
+slab_t *slab_new(const size_t size)
+{
+  size_t n = (size + SLAB_LINE - 1) & ~((size_t)SLAB_LINE - 1);
+  if (n > SLAB_BYTES - SLAB_LINE) return NULL;
+
+  slab_t *slab = calloc(1, sizeof(struct _slab));
+  if (!slab) return NULL;
+  slab->size = n;
+  slab->per = (SLAB_BYTES - SLAB_LINE) / n;
+  pthread_mutex_init(&slab->lock, NULL);
+  return slab;
+}
+
+/* the objects still in use go with it */
+void slab_destroy(slab_t *slab)
+{
+  int i;
+  if (!slab) return;
+  for (i = 0; i < slab->nslabs; i++) free(slab->slabs[i]);
+  pthread_mutex_destroy(&slab->lock);
+  free(slab);
+}
+
+void *slab_alloc(slab_t *slab)
+{
+  unsigned long long top;
+  char *obj;
+
+  do {
+    top = slab->top;
+    if (!(top & SLAB_INDEX)) {
+      if (!_grow(slab)) return NULL;
+      continue;
+    }
+    /* the link may be stale if the object was taken, the tag tells */
+    obj = _obj(slab, (top & SLAB_INDEX) - 1);
+    if (__sync_bool_compare_and_swap(&slab->top, top,
+                                     ((top >> 32) + 1) << 32 | _link(obj)))
+      break;
+  } while (1);
+
+  long used = __sync_add_and_fetch(&slab->nused, 1);
+  long peak = slab->npeak;
+  while (used > peak &&
+         !__sync_bool_compare_and_swap(&slab->npeak, peak, used))
+    peak = slab->npeak;
+  return obj;
+}
+
+void slab_free(slab_t *slab,
+               void *ptr)
+{
+  if (!ptr) return;
+  _push(slab, _index(slab, ptr), ptr);
+  __sync_fetch_and_sub(&slab->nused, 1);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+
+#define SLAB_LINE 64        /* bytes, objects start on a cache line */
+#define SLAB_BYTES 65536    /* of a slab, which is aligned to its size */
+#define SLAB_MAX 1024       /* slabs of a pool, 64M at most */
+
+
+/*
+ * a pool of objects of one size: slabs are carved into objects, which
+ * go back to a lock-free free list and never to malloc until the pool
+ * is destroyed; the list is a tagged index so a pop can't be fooled by
+ * an object freed and taken again meanwhile (ABA)
+ */
+typedef struct _slab slab_t;
+
+struct _slab {
+  volatile unsigned long long top;  /* tag << 32 | index + 1, 0 if empty */
+  size_t size;               /* of an object, whole cache lines */
+  int per;                   /* objects in a slab */
+  char *slabs[SLAB_MAX];
+  volatile int nslabs;
+  pthread_mutex_t lock;      /* only to add a slab */
+
+  /* metrics, updated atomically */
+  volatile long nused;       /* objects taken and not freed */
+  volatile long npeak;
+};
+
+
+slab_t *slab_new(const size_t size);
+
+void slab_destroy(slab_t *slab);
+
+void *slab_alloc(slab_t *slab);
+
+void slab_free(slab_t *slab,
+               void *ptr);
+
+
+#endif
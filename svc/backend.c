@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libpq-fe.h>
+#include "json.h"
+#include "pg_conn.h"
+#include "sqlobj.h"
+#include "sqlops.h"
+#include "backend.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+/* PostgreSQL through libpq, the queries run on the connection pool */
+
+static int _pg_query(backend_t *be,
+                     sqlreq_t *q,
+                     const long wait)
+{
+  q->slot = pg_pool_get((pgpool_t *)be->db, wait);
+  if (!q->slot) return SQL_BUSY;
+  /* a full socket must not block the worker, the event loop waits */
+  PQsetnonblocking(q->slot->conn, 1);
+  return q->array ? sql_send_pipeline(q) : sql_send_select(q);
+}
+
+static int _pg_export(backend_t *be,
+                      sqlreq_t *q,
+                      const int format,
+                      const long wait)
+{
+  q->slot = pg_pool_get((pgpool_t *)be->db, wait);
+  if (!q->slot) return SQL_BUSY;
+  PQsetnonblocking(q->slot->conn, 1);
+  return sql_send_export(q, format);
+}
+
+static int _pg_resume(backend_t *be,
+                      sqlreq_t *q)
+{
+  return sql_resume(q);
+}
+
+static int _pg_socket(sqlreq_t *q)
+{
+  return PQsocket(q->slot->conn);
+}
+
+static int _pg_flush(sqlreq_t *q)
+{
+  return PQflush(q->slot->conn) != 0;
+}
+
+static PGcancel *_pg_cancel(sqlreq_t *q)
+{
+  return PQgetCancel(q->slot->conn);
+}
+
+static void _pg_release(backend_t *be,
+                        sqlreq_t *q)
+{
+  if (!q->slot) return;
+  pg_pool_put((pgpool_t *)be->db, q->slot);
+  q->slot = NULL;
+}
+
+static void _pg_close(backend_t *be)
+{
+  pg_pool_destroy((pgpool_t *)be->db);
+}
+
+/* the backend owns the pool from now on */
+backend_t *backend_pg(pgpool_t *pool)
+{
+  backend_t *be = calloc(1, sizeof(struct _backend));
+  be->name = "libpq";
+  be->db = pool;
+  be->query = _pg_query;
+  be->export = _pg_export;
+  be->resume = _pg_resume;
+  be->socket = _pg_socket;
+  be->flush = _pg_flush;
+  be->cancel = _pg_cancel;
+  be->release = _pg_release;
+  be->close = _pg_close;
+  return be;
+}
+
+void backend_close(backend_t *be)
+{
+  be->close(be);
+  free(be);
+}
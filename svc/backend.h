@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#ifndef _BACKEND_
+#define _BACKEND_
+
+
+#define BACKEND_ENV "MAESTRO_BACKEND"  /* "mock:<fixture>", else libpq */
+
+
+typedef struct _backend backend_t;
+
+/* where the SELECTs of the requests go */
+struct _backend {
+  const char *name;
+  void *db;          /* the connection pool, or the tables of the mock */
+
+  /*
+   * start the queries of q, waiting at most wait ms for a connection;
+   * SQL_WAIT until socket() is readable, SQL_MORE if resume() can go on
+   * now, SQL_BUSY without a connection, or SQL_ERROR
+   */
+  int (*query)(backend_t *be,
+               sqlreq_t *q,
+               const long wait);
+  /* the same for a table export, NULL if it is not supported */
+  int (*export)(backend_t *be,
+                sqlreq_t *q,
+                const int format,
+                const long wait);
+  /* SQL_MORE with each batch of rows, then SQL_DONE or SQL_ERROR */
+  int (*resume)(backend_t *be,
+                sqlreq_t *q);
+  int (*socket)(sqlreq_t *q);
+  /* push out what is queued, 1 while some is left (socket() writable) */
+  int (*flush)(sqlreq_t *q);
+  /* to cancel the query from another thread, NULL if it can't be */
+  PGcancel *(*cancel)(sqlreq_t *q);
+  /* the rows are all in, the connection can go */
+  void (*release)(backend_t *be,
+                  sqlreq_t *q);
+  void (*close)(backend_t *be);
+};
+
+
+backend_t *backend_pg(pgpool_t *pool);
+
+backend_t *backend_mock(const char *fixture);
+
+void backend_close(backend_t *be);
+
+
+#endif
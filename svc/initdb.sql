@@ -27,3 +27,15 @@ INSERT INTO users VALUES(DEFAULT, 'Tom', 'Bear', 'tb@magicworld.com', 198);
 INSERT INTO users VALUES(DEFAULT, 'Larry', 'King', 'lk@cnn.com', 75);
 INSERT INTO users VALUES(DEFAULT, 'Donald', 'Trump', 'dt@usa.com', 75);
 INSERT INTO users VALUES(DEFAULT, 'Bill', 'Clinton', 'bc@usa.com', 73);
+
+-- tell the server which table changed, its query result cache listens
+CREATE FUNCTION notify_change() RETURNS trigger AS $$
+BEGIN
+  PERFORM pg_notify('maestro_cache', TG_TABLE_NAME);
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER users_notify
+  AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON users
+  FOR EACH STATEMENT EXECUTE FUNCTION notify_change();
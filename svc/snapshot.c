@@ -0,0 +1,594 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <libpq-fe.h>
+#include "util.h"
+#include "json.h"
+#include "pg_conn.h"
+#include "sqlobj.h"
+#include "sqlops.h"
+#include "snapshot.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+#define SNAP_EQ 0
+#define SNAP_NE 1
+#define SNAP_LT 2
+#define SNAP_LE 3
+#define SNAP_GT 4
+#define SNAP_GE 5
+
+#define SNAP_INT_EXACT 9007199254740992.0  /* 2^53, doubles hold int8 below */
+
+
+/* a condition of the where clause */
+typedef struct _snapcond {
+  int col;
+  int op;
+  double num;       /* SNAP_FILT_NUM */
+  jsonbuf_t str;    /* SNAP_FILT_STR, the literal as json */
+} snapcond_t;
+
+struct _snapscan {
+  snaptab_t *t;
+  int viscols;
+  int cols[64];      /* the projection */
+  int ncols;
+  snapcond_t conds[SNAP_CONDS];
+  int nconds;
+  long row;          /* the next one to look at, -1 before the head */
+  long n;            /* rows written */
+};
+
+
+static void _tab_destroy(snaptab_t *t)
+{
+  int j;
+  for (j = 0; j < t->ncols; j++) free(t->names[j]);
+  free(t->names);
+  free(t->types);
+  free(t->filt);
+  free(t->offs);
+  free(t->nums);
+  json_free(&t->vals);
+  free(t);
+}
+
+void snaptab_release(snaptab_t *t)
+{
+  if (__sync_sub_and_fetch(&t->refs, 1) == 0) _tab_destroy(t);
+}
+
+static int _filt_kind(const Oid type)
+{
+  switch (type) {
+    /* a double holds them as the database compares them */
+    case OID_INT2: case OID_INT4: case OID_INT8: case OID_FLOAT8:
+      return SNAP_FILT_NUM;
+    /*
+     * float4 = 0.1 is false as a float4 is no double, a numeric has more
+     * digits than a double; bpchar pads, timestamps compare as times: the
+     * database knows best
+     */
+    case OID_TEXT: case OID_VARCHAR: case OID_NAME:
+      return SNAP_FILT_STR;
+  }
+  return SNAP_FILT_NONE;
+}
+
+/* the values of a result, serialized as the SELECTs serialize them */
+snaptab_t *snaptab_new(const char *table,
+                       const PGresult *res)
+{
+  int i, j;
+  snaptab_t *t = calloc(1, sizeof(struct _snaptab));
+  strcpy(t->table, table);
+  t->ncols = PQnfields(res);
+  t->nrows = PQntuples(res);
+  t->names = malloc(t->ncols * sizeof(char *));
+  t->types = malloc(t->ncols * sizeof(Oid));
+  t->filt = malloc(t->ncols);
+  t->offs = malloc(t->ncols * (t->nrows + 1) * sizeof(int));
+  t->nums = malloc((t->ncols * t->nrows + 1) * sizeof(double));
+  json_init(&t->vals, SQL_BUF_SIZE);
+  t->refs = 1;
+
+  for (j = 0; j < t->ncols; j++) {
+    int *offs = &t->offs[j * (t->nrows + 1)];
+    double *nums = &t->nums[j * t->nrows];
+
+    t->names[j] = strdup(PQfname(res, j));
+    t->types[j] = PQftype(res, j);
+    t->filt[j] = _filt_kind(t->types[j]);
+
+    for (i = 0; i < t->nrows; i++) {
+      const char *v = PQgetvalue(res, i, j);
+      offs[i] = t->vals.len;
+      nums[i] = NAN;
+      if (PQgetisnull(res, i, j)) {
+        json_puts(&t->vals, "null");
+        continue;
+      }
+      sql_put_text(&t->vals, t->types[j], v, PQgetlength(res, i, j));
+      if (t->filt[j] == SNAP_FILT_NUM) {
+        nums[i] = strtod(v, NULL);
+        /* an int8 a double can't hold is compared by the database */
+        double mag = nums[i] < 0 ? -nums[i] : nums[i];
+        if (mag >= SNAP_INT_EXACT && t->types[j] == OID_INT8)
+          t->filt[j] = SNAP_FILT_NONE;
+      }
+    }
+    offs[t->nrows] = t->vals.len;
+  }
+  return t;
+}
+
+/* read the whole table, NULL if it can't be or it is too large */
+static snaptab_t *_load(snapshot_t *snap,
+                        const char *table)
+{
+  pgslot_t *slot = pg_pool_get(snap->pool, PG_POOL_WAIT);
+  if (!slot) return NULL;
+
+  char sql[64];
+  strbld(strbld(sql, "SELECT * FROM "), table);
+  PGresult *res = PQexec(slot->conn, sql);
+  pg_pool_put(snap->pool, slot);
+
+  snaptab_t *t = NULL;
+  if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+    D_PRINT("[SNAP] loading %s failed: %s\n", table, PQresultErrorMessage(res));
+  }
+  else if (PQntuples(res) > SNAP_ROWS_MAX) {
+    D_PRINT("[SNAP] %s is too large to keep\n", table);
+  }
+  else
+    t = snaptab_new(table, res);
+  PQclear(res);
+
+  if (t) {
+    __sync_fetch_and_add(&snap->nloads, 1);
+    D_PRINT("[SNAP] %s loaded, %ld rows\n", table, t->nrows);
+  }
+  return t;
+}
+
+static void _abstime(struct timespec *ts,
+                     const long ms)
+{
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+/* loads the tables when they change or are due, one at a time */
+static void *_refresher(void *arg)
+{
+  snapshot_t *snap = (snapshot_t *)arg;
+  int i;
+
+  pthread_mutex_lock(&snap->lock);
+  while (snap->running) {
+    long now = mstime();
+    long wait = SNAP_REFRESH;
+
+    for (i = 0; i < snap->ntabs && snap->running; i++) {
+      if (snap->gen[i] == snap->loaded_gen[i] && now < snap->next[i]) {
+        if (snap->next[i] - now < wait) wait = snap->next[i] - now;
+        continue;
+      }
+
+      long gen = snap->gen[i];
+      snap->loaded_gen[i] = gen;
+      pthread_mutex_unlock(&snap->lock);
+      snaptab_t *t = _load(snap, snap->names[i]);
+      pthread_mutex_lock(&snap->lock);
+
+      now = mstime();
+      snap->next[i] = now + (t ? SNAP_REFRESH : SNAP_RETRY);
+      if (!t) continue;
+      /* a change during the load, the next round reads it again */
+      if (gen != snap->gen[i]) {
+        snaptab_release(t);
+        wait = 0;
+        continue;
+      }
+      snaptab_t *old = snap->tabs[i];
+      snap->tabs[i] = t;
+      if (old) snaptab_release(old);
+    }
+
+    if (wait > 0 && snap->running) {
+      struct timespec until;
+      _abstime(&until, wait);
+      pthread_cond_timedwait(&snap->cond, &snap->lock, &until);
+    }
+  }
+  pthread_mutex_unlock(&snap->lock);
+  return NULL;
+}
+
+/*
+ * keep the tables of a comma separated list in memory, they are loaded
+ * by a thread of their own; until then the database answers for them
+ */
+snapshot_t *snapshot_new(pgpool_t *pool,
+                         const char *tables)
+{
+  snapshot_t *snap = calloc(1, sizeof(struct _snapshot));
+  snap->pool = pool;
+  snap->running = 1;
+
+  const char *s = tables;
+  while (*s && snap->ntabs < SNAP_TABLES) {
+    int len = strcspn(s, ",");
+    if (len && len < 17) {
+      memcpy(snap->names[snap->ntabs], s, len);
+      snap->names[snap->ntabs][len] = '\0';
+      /* loaded on the first round */
+      snap->gen[snap->ntabs++] = 1;
+    }
+    s += len;
+    if (*s) s++;
+  }
+
+  pthread_mutex_init(&snap->lock, NULL);
+  pthread_cond_init(&snap->cond, NULL);
+  if (pthread_create(&snap->tid, NULL, _refresher, snap) != 0) {
+    perror("pthread_create()");
+    pthread_mutex_destroy(&snap->lock);
+    pthread_cond_destroy(&snap->cond);
+    free(snap);
+    return NULL;
+  }
+  return snap;
+}
+
+void snapshot_destroy(snapshot_t *snap)
+{
+  int i;
+  pthread_mutex_lock(&snap->lock);
+  snap->running = 0;
+  pthread_cond_signal(&snap->cond);
+  pthread_mutex_unlock(&snap->lock);
+  pthread_join(snap->tid, NULL);
+
+  for (i = 0; i < snap->ntabs; i++)
+    if (snap->tabs[i]) snaptab_release(snap->tabs[i]);
+  pthread_mutex_destroy(&snap->lock);
+  pthread_cond_destroy(&snap->cond);
+  free(snap);
+}
+
+/*
+ * the table changed (all of them if NULL), it is not served until it is
+ * loaded again; fits the changed hook of the result cache
+ */
+void snapshot_changed(void *arg,
+                      const char *table)
+{
+  snapshot_t *snap = (snapshot_t *)arg;
+  int i;
+
+  pthread_mutex_lock(&snap->lock);
+  for (i = 0; i < snap->ntabs; i++) {
+    if (table && strcmp(snap->names[i], table) != 0) continue;
+    snap->gen[i]++;
+    if (snap->tabs[i]) {
+      snaptab_release(snap->tabs[i]);
+      snap->tabs[i] = NULL;
+    }
+  }
+  pthread_cond_signal(&snap->cond);
+  pthread_mutex_unlock(&snap->lock);
+}
+
+static const char *_skip(const char *s)
+{
+  while (isspace((unsigned char)*s)) s++;
+  return s;
+}
+
+/* a keyword, in any case, as a whole word */
+static int _word(const char **s,
+                 const char *word)
+{
+  int len = strlen(word);
+  if (strncasecmp(*s, word, len) != 0) return 0;
+  if (isalnum((unsigned char)(*s)[len]) || (*s)[len] == '_') return 0;
+  *s = _skip(*s + len);
+  return 1;
+}
+
+/* an unquoted identifier, folded to lower case as the server does */
+static int _column(const snaptab_t *t,
+                   const char **s)
+{
+  char name[64];
+  int len = 0;
+  const char *p = *s;
+
+  if (!isalpha((unsigned char)*p) && *p != '_') return -1;
+  while ((isalnum((unsigned char)*p) || *p == '_') && len < 63)
+    name[len++] = tolower((unsigned char)*p++);
+  name[len] = '\0';
+
+  int j;
+  for (j = 0; j < t->ncols; j++) {
+    if (strcmp(t->names[j], name) == 0) {
+      *s = _skip(p);
+      return j;
+    }
+  }
+  return -1;
+}
+
+static int _op(const char **s)
+{
+  static const char *ops[] = { "<>", "!=", "<=", ">=", "=", "<", ">" };
+  static const int codes[] = { SNAP_NE, SNAP_NE, SNAP_LE, SNAP_GE,
+                               SNAP_EQ, SNAP_LT, SNAP_GT };
+  int i;
+  for (i = 0; i < 7; i++) {
+    int len = strlen(ops[i]);
+    if (strncmp(*s, ops[i], len) == 0) {
+      *s = _skip(*s + len);
+      return codes[i];
+    }
+  }
+  return -1;
+}
+
+/* a 'quoted' literal, '' is a quote, kept as its json string */
+static int _string(snapcond_t *c,
+                   const char **s)
+{
+  char lit[128];
+  int len = 0;
+  const char *p = *s + 1;
+
+  while (*p && len < 127) {
+    if (*p == '\'') {
+      if (p[1] != '\'') break;
+      p++;
+    }
+    lit[len++] = *p++;
+  }
+  if (*p != '\'') return 0;
+
+  json_init(&c->str, len + 8);
+  json_put_str(&c->str, lit, len);
+  *s = _skip(p + 1);
+  return 1;
+}
+
+/*
+ * the conditions of " WHERE a op literal [AND ...]", returns how many
+ * there are, or -1 if the clause is beyond what is served from memory
+ */
+static int _parse_clause(const snaptab_t *t,
+                         const char *clause,
+                         snapcond_t *conds)
+{
+  int n = 0;
+  const char *s = _skip(clause);
+  if (!*s) return 0;
+  if (!_word(&s, "WHERE")) return -1;
+
+  do {
+    if (n == SNAP_CONDS) return -1;
+    snapcond_t *c = &conds[n];
+    if ((c->col = _column(t, &s)) < 0) return -1;
+    if ((c->op = _op(&s)) < 0) return -1;
+
+    if (*s == '\'') {
+      if (t->filt[c->col] != SNAP_FILT_STR) return -1;
+      if (c->op != SNAP_EQ && c->op != SNAP_NE) return -1;
+      if (!_string(c, &s)) return -1;
+    }
+    else {
+      char *end;
+      if (t->filt[c->col] != SNAP_FILT_NUM) return -1;
+      c->num = strtod(s, &end);
+      if (end == s || isalpha((unsigned char)*end) || *end == '_')
+        return -1;
+      /* an integer is compared exactly, a literal past 2^53 is not */
+      if (t->types[c->col] != OID_FLOAT8 &&
+          (c->num >= SNAP_INT_EXACT || c->num <= -SNAP_INT_EXACT))
+        return -1;
+      s = _skip(end);
+    }
+    n++;
+  } while (_word(&s, "AND"));
+
+  return *s ? -1 : n;
+}
+
+static void _free_conds(snapcond_t *conds,
+                        const int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    if (conds[i].str.buf) json_free(&conds[i].str);
+}
+
+/* a null is neither equal nor unequal to anything, as in sql */
+static int _match(const snaptab_t *t,
+                  const snapcond_t *conds,
+                  const int n,
+                  const long row)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    const snapcond_t *c = &conds[i];
+    if (c->str.buf) {
+      const int *offs = &t->offs[c->col * (t->nrows + 1)];
+      const char *v = t->vals.buf + offs[row];
+      int len = offs[row + 1] - offs[row];
+      if (v[0] != '"') return 0;
+      int eq = len == c->str.len && memcmp(v, c->str.buf, len) == 0;
+      if (eq != (c->op == SNAP_EQ)) return 0;
+      continue;
+    }
+
+    double v = t->nums[c->col * t->nrows + row];
+    if (isnan(v)) return 0;
+    switch (c->op) {
+      case SNAP_EQ: if (!(v == c->num)) return 0; break;
+      case SNAP_NE: if (!(v != c->num)) return 0; break;
+      case SNAP_LT: if (!(v < c->num)) return 0; break;
+      case SNAP_LE: if (!(v <= c->num)) return 0; break;
+      case SNAP_GT: if (!(v > c->num)) return 0; break;
+      case SNAP_GE: if (!(v >= c->num)) return 0; break;
+    }
+  }
+  return 1;
+}
+
+/* the columns of qfield, all of them if it is empty or "*" */
+static int _project(const snaptab_t *t,
+                    const char *qfield,
+                    int *cols)
+{
+  int n = 0;
+  const char *s = _skip(qfield);
+
+  if (!*s || (*s == '*' && !*_skip(s + 1))) {
+    for (n = 0; n < t->ncols; n++) cols[n] = n;
+    return n;
+  }
+
+  do {
+    if (n == 64) return -1;
+    if ((cols[n++] = _column(t, &s)) < 0) return -1;
+    if (*s != ',') break;
+    s = _skip(s + 1);
+  } while (1);
+
+  return *s ? -1 : n;
+}
+
+/*
+ * a SELECT on a table in memory, NULL if the query is beyond the
+ * projections and simple conditions served here; it holds a reference
+ * to the table until it is destroyed
+ */
+snapscan_t *snapscan_new(snaptab_t *t,
+                         const sqlobj_t *sqlo)
+{
+  snapscan_t *scan = calloc(1, sizeof(struct _snapscan));
+  scan->ncols = _project(t, sqlo->qfield, scan->cols);
+  scan->nconds = _parse_clause(t, sqlo->clause, scan->conds);
+  if (scan->ncols < 0 || scan->nconds < 0) {
+    _free_conds(scan->conds, SNAP_CONDS);
+    free(scan);
+    return NULL;
+  }
+
+  __sync_fetch_and_add(&t->refs, 1);
+  scan->t = t;
+  scan->viscols = sqlo->viscols;
+  scan->row = -1;
+  return scan;
+}
+
+void snapscan_destroy(snapscan_t *scan)
+{
+  _free_conds(scan->conds, SNAP_CONDS);
+  snaptab_release(scan->t);
+  free(scan);
+}
+
+/*
+ * the json of the rows, as the database path writes it, until out holds
+ * batch bytes (0 for no limit); returns 1 once the json is complete
+ */
+int snapscan_rows(snapscan_t *scan,
+                  jsonbuf_t *out,
+                  const int batch)
+{
+  const snaptab_t *t = scan->t;
+  int k;
+
+  if (scan->row < 0) {
+    json_puts(out, "{");
+    if (scan->viscols) {
+      json_puts(out, "\"h\":{\"hd\":[");
+      for (k = 0; k < scan->ncols; k++) {
+        if (k) json_puts(out, ",");
+        const char *name = t->names[scan->cols[k]];
+        json_put_str(out, name, strlen(name));
+      }
+      json_puts(out, "]},");
+    }
+    json_puts(out, "\"d\":{");
+    scan->row = 0;
+  }
+
+  for (; scan->row < t->nrows; scan->row++) {
+    long i = scan->row;
+    if (batch && out->len >= batch) return 0;
+    if (!_match(t, scan->conds, scan->nconds, i)) continue;
+    json_puts(out, scan->n ? ",\"r" : "\"r");
+    json_put_long(out, scan->n++, 3);
+    json_puts(out, "\":[");
+    for (k = 0; k < scan->ncols; k++) {
+      const int *offs = &t->offs[scan->cols[k] * (t->nrows + 1)];
+      if (k) json_puts(out, ",");
+      json_put(out, t->vals.buf + offs[i], offs[i + 1] - offs[i]);
+    }
+    json_puts(out, "]");
+  }
+  json_puts(out, "}}");
+  return 1;
+}
+
+/*
+ * answer a SELECT from memory into out, as the database would have; 0 if
+ * the table is not kept, is being reloaded, or the query is beyond the
+ * projections and simple conditions served here
+ */
+int snapshot_select(snapshot_t *snap,
+                    const sqlobj_t *sqlo,
+                    jsonbuf_t *out)
+{
+  int i;
+  snaptab_t *t = NULL;
+
+  pthread_mutex_lock(&snap->lock);
+  for (i = 0; i < snap->ntabs; i++) {
+    if (strcmp(snap->names[i], sqlo->table) == 0) {
+      t = snap->tabs[i];
+      if (t) __sync_fetch_and_add(&t->refs, 1);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&snap->lock);
+  if (!t) return 0;
+
+  snapscan_t *scan = snapscan_new(t, sqlo);
+  snaptab_release(t);
+  if (!scan) return 0;
+
+  snapscan_rows(scan, out, 0);
+  snapscan_destroy(scan);
+  __sync_fetch_and_add(&snap->nhits, 1);
+  return 1;
+}
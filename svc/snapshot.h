@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#ifndef _SNAPSHOT_
+#define _SNAPSHOT_
+
+
+#define SNAP_TABLES 8          /* tables kept in memory */
+#define SNAP_REFRESH 60000     /* ms, reloaded even if no change is heard of */
+#define SNAP_RETRY 5000        /* ms, after a load which failed */
+#define SNAP_ROWS_MAX 100000   /* larger tables are left to the database */
+#define SNAP_CONDS 8           /* conditions in a clause */
+
+/* the conditions a column can be filtered with */
+#define SNAP_FILT_NONE 0
+#define SNAP_FILT_NUM 1        /* =, <>, <, <=, >, >= on the numbers */
+#define SNAP_FILT_STR 2        /* = and <> on the strings */
+
+
+typedef struct _snaptab snaptab_t;
+
+/* a table as columns of json values, serialized once when it is loaded */
+struct _snaptab {
+  char table[17];
+  int ncols;
+  long nrows;
+  char **names;
+  Oid *types;
+  char *filt;        /* SNAP_FILT_xxx of each column */
+  jsonbuf_t vals;    /* the json of every value, column after column */
+  int *offs;         /* value (col, row) starts at col * (nrows + 1) + row */
+  double *nums;      /* the numeric columns again, NaN for null */
+  volatile int refs;
+};
+
+/* a SELECT running on a table in memory */
+typedef struct _snapscan snapscan_t;
+
+typedef struct _snapshot snapshot_t;
+
+struct _snapshot {
+  pgpool_t *pool;
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+
+  int ntabs;
+  char names[SNAP_TABLES][17];
+  snaptab_t *tabs[SNAP_TABLES];  /* NULL until it is loaded, or changed */
+  long gen[SNAP_TABLES];         /* bumped on every change */
+  long loaded_gen[SNAP_TABLES];  /* the gen the last load started in */
+  long next[SNAP_TABLES];        /* ms, when it is loaded again */
+
+  /* metrics */
+  volatile long nhits;
+  volatile long nloads;
+};
+
+
+snaptab_t *snaptab_new(const char *table,
+                       const PGresult *res);
+
+void snaptab_release(snaptab_t *t);
+
+snapscan_t *snapscan_new(snaptab_t *t,
+                         const sqlobj_t *sqlo);
+
+void snapscan_destroy(snapscan_t *scan);
+
+int snapscan_rows(snapscan_t *scan,
+                  jsonbuf_t *out,
+                  const int batch);
+
+snapshot_t *snapshot_new(pgpool_t *pool,
+                         const char *tables);
+
+void snapshot_destroy(snapshot_t *snap);
+
+void snapshot_changed(void *arg,
+                      const char *table);
+
+int snapshot_select(snapshot_t *snap,
+                    const sqlobj_t *sqlo,
+                    jsonbuf_t *out);
+
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libpq-fe.h>
+#include "util.h"
+#include "deflate.h"
+#include "mime.h"
+#include "zpolicy.h"
+#include "pg_conn.h"
+#include "sqlobj.h"
+#include "sqlcache.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+static unsigned _hash(const char *key)
+{
+  /* FNV-1a */
+  unsigned h = 2166136261u;
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619u;
+  }
+  return h % SQLCACHE_BUCKETS;
+}
+
+static void _entry_destroy(sqlentry_t *entry)
+{
+  free(entry->key);
+  free(entry->body);
+  if (entry->body_zipped) free(entry->body_zipped);
+  free(entry);
+}
+
+/* out of the age list, before it leaves its bucket, under the lock */
+static void _unage(sqlcache_t *cache,
+                   sqlentry_t *entry)
+{
+  if (entry->older) entry->older->newer = entry->newer;
+  else cache->oldest = entry->newer;
+  if (entry->newer) entry->newer->older = entry->older;
+  else cache->newest = entry->older;
+  cache->bytes -= entry->size;
+}
+
+/* drop the oldest entry to make room, under the lock */
+static void _evict(sqlcache_t *cache)
+{
+  sqlentry_t *entry = cache->oldest;
+  sqlentry_t **p = &cache->buckets[_hash(entry->key)];
+  while (*p != entry) p = &(*p)->next;
+  *p = entry->next;
+  _unage(cache, entry);
+  D_PRINT("[SQLCACHE] evicted %s\n", entry->key);
+  sqlcache_release(entry);
+}
+
+/* drop the entries matching table (all of them if NULL), under the lock */
+static void _drop(sqlcache_t *cache,
+                  const char *table,
+                  const long now)
+{
+  int i;
+  for (i = 0; i < SQLCACHE_BUCKETS; i++) {
+    sqlentry_t **p = &cache->buckets[i];
+    while (*p) {
+      sqlentry_t *entry = *p;
+      if ((!table && !now) ||
+          (table && strcmp(entry->table, table) == 0) ||
+          (now && now >= entry->expire)) {
+        *p = entry->next;
+        _unage(cache, entry);
+        sqlcache_release(entry);
+      }
+      else
+        p = &entry->next;
+    }
+  }
+}
+
+sqlcache_t *sqlcache_new()
+{
+  sqlcache_t *cache = calloc(1, sizeof(struct _sqlcache));
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+void sqlcache_destroy(sqlcache_t *cache)
+{
+  _drop(cache, NULL, 0);
+  if (cache->listener) PQfinish(cache->listener);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+/*
+ * the normalized query, what makes two SELECTs return the same json;
+ * returns 0 if it doesn't fit, such a query is neither cached nor shared
+ */
+int sqlcache_key(char *key,
+                 const sqlobj_t *sqlo)
+{
+  if (strlen(sqlo->table) >= sizeof(((sqlentry_t *)0)->table)) return 0;
+  int n = snprintf(key, SQLCACHE_KEY_SIZE, "%s|%s|%s|%s|%d", sqlo->cmd,
+                   sqlo->table, sqlo->qfield, sqlo->clause, sqlo->viscols);
+  return n < SQLCACHE_KEY_SIZE;
+}
+
+/* a live entry with a reference for the caller, NULL on a miss */
+sqlentry_t *sqlcache_get(sqlcache_t *cache,
+                         const char *key)
+{
+  long now = mstime();
+  sqlentry_t *entry;
+
+  pthread_mutex_lock(&cache->lock);
+  entry = cache->buckets[_hash(key)];
+  while (entry && strcmp(entry->key, key) != 0) entry = entry->next;
+  if (entry && now >= entry->expire) entry = NULL;
+  if (entry) __sync_fetch_and_add(&entry->refs, 1);
+  pthread_mutex_unlock(&cache->lock);
+
+  return entry;
+}
+
+void sqlcache_release(sqlentry_t *entry)
+{
+  if (__sync_sub_and_fetch(&entry->refs, 1) == 0) _entry_destroy(entry);
+}
+
+/*
+ * store the json of a query, the cache takes body over; gen is the
+ * cache->gen read before the query was sent, the result is dropped if
+ * an invalidation came in meanwhile; the oldest entries make room for it
+ */
+void sqlcache_put(sqlcache_t *cache,
+                  const char *key,
+                  const char *table,
+                  char *body,
+                  const int len_body,
+                  const long gen)
+{
+  sqlentry_t *entry = calloc(1, sizeof(struct _sqlentry));
+  entry->key = strdup(key);
+  strcpy(entry->table, table);
+  entry->body = body;
+  entry->len_body = len_body;
+  entry->expire = mstime() + SQLCACHE_TTL;
+  entry->refs = 1;
+
+  /* keep the compressed copy as well, most clients take it */
+  int zlvl = zpolicy_level("application/json", MIME_TXT, len_body);
+  if (zlvl != ZP_NONE) {
+    struct sdefl c;
+    unsigned char *zipped = malloc(deflate_bound(len_body));
+    int len_zipped = deflate(&c, zipped, body, len_body, zlvl);
+    if (len_zipped < len_body) {
+      entry->body_zipped = zipped;
+      entry->len_zipped = len_zipped;
+    }
+    else
+      free(zipped);
+  }
+  entry->size = sizeof(struct _sqlentry) + strlen(key) + len_body +
+                entry->len_zipped;
+
+  unsigned h = _hash(key);
+  pthread_mutex_lock(&cache->lock);
+  if (gen != cache->gen) {
+    pthread_mutex_unlock(&cache->lock);
+    D_PRINT("[SQLCACHE] stale result of %s not cached\n", key);
+    _entry_destroy(entry);
+    return;
+  }
+
+  /* replace the entry of the same key */
+  sqlentry_t **p = &cache->buckets[h];
+  while (*p && strcmp((*p)->key, key) != 0) p = &(*p)->next;
+  if (*p) {
+    sqlentry_t *old = *p;
+    *p = old->next;
+    _unage(cache, old);
+    sqlcache_release(old);
+  }
+  while (cache->oldest && cache->bytes + entry->size > SQLCACHE_BYTES_MAX)
+    _evict(cache);
+
+  entry->next = cache->buckets[h];
+  cache->buckets[h] = entry;
+  entry->older = cache->newest;
+  if (cache->newest) cache->newest->newer = entry;
+  else cache->oldest = entry;
+  cache->newest = entry;
+  cache->bytes += entry->size;
+  pthread_mutex_unlock(&cache->lock);
+  D_PRINT("[SQLCACHE] cached %s (%d bytes)\n", key, len_body);
+}
+
+/* drop the results of a table, all of them if table is NULL */
+void sqlcache_invalidate(sqlcache_t *cache,
+                         const char *table)
+{
+  pthread_mutex_lock(&cache->lock);
+  cache->gen++;
+  _drop(cache, table, 0);
+  pthread_mutex_unlock(&cache->lock);
+  D_PRINT("[SQLCACHE] invalidated %s\n", table ? table : "all");
+  if (cache->changed) cache->changed(cache->changed_arg, table);
+}
+
+void sqlcache_expire(sqlcache_t *cache)
+{
+  pthread_mutex_lock(&cache->lock);
+  _drop(cache, NULL, mstime());
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * open the connection which LISTENs for the table changes, returns its
+ * socket for the event loop or -1; as notifications may have been missed
+ * while it was down, the whole cache is dropped
+ */
+int sqlcache_listen(sqlcache_t *cache,
+                    const char *conninfo,
+                    const char *schema)
+{
+  PGconn *conn = pg_open(conninfo, schema);
+  if (!conn) return -1;
+
+  PGresult *res = PQexec(conn, "LISTEN " SQLCACHE_CHANNEL);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    D_PRINT("[SQLCACHE] LISTEN failed: %s\n", PQerrorMessage(conn));
+    PQclear(res);
+    PQfinish(conn);
+    return -1;
+  }
+  PQclear(res);
+
+  sqlcache_invalidate(cache, NULL);
+  cache->listener = conn;
+  return PQsocket(conn);
+}
+
+/*
+ * the listener socket is readable, or in error: drop what the
+ * notifications name, or the listener with the whole cache
+ */
+void sqlcache_notified(sqlcache_t *cache)
+{
+  PGconn *conn = cache->listener;
+  PGnotify *notify;
+
+  if (!conn) return;
+  if (!PQconsumeInput(conn)) {
+    D_PRINT("[SQLCACHE] listener lost: %s\n", PQerrorMessage(conn));
+    PQfinish(conn);
+    cache->listener = NULL;
+    sqlcache_invalidate(cache, NULL);
+    return;
+  }
+
+  while ((notify = PQnotifies(conn))) {
+    sqlcache_invalidate(cache, notify->extra[0] ? notify->extra : NULL);
+    PQfreemem(notify);
+  }
+}
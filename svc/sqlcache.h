@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#ifndef _SQLCACHE_
+#define _SQLCACHE_
+
+
+#define SQLCACHE_BUCKETS 256
+#define SQLCACHE_KEY_SIZE 320
+#define SQLCACHE_TTL 30000        /* ms, bounds staleness if a notify is lost */
+#define SQLCACHE_ENTRY_MAX 65536  /* larger results are not cached */
+#define SQLCACHE_BYTES_MAX (16 << 20)  /* of all entries, the oldest go first */
+#define SQLCACHE_CHANNEL "maestro_cache"  /* payload: the changed table */
+
+
+typedef struct _sqlentry sqlentry_t;
+
+struct _sqlentry {
+  char *key;
+  char table[64];              /* NAMEDATALEN, as postgres cuts names */
+  char *body;                  /* the serialized json */
+  unsigned char *body_zipped;  /* NULL if it is not worth it */
+  int len_body;
+  int len_zipped;
+  long expire;                 /* ms */
+  long size;                   /* bytes, counted against SQLCACHE_BYTES_MAX */
+  volatile int refs;           /* the table holds one */
+  struct _sqlentry *next;
+  struct _sqlentry *older;     /* by age, the same ttl makes it by expiry */
+  struct _sqlentry *newer;
+};
+
+typedef struct _sqlcache sqlcache_t;
+
+struct _sqlcache {
+  sqlentry_t *buckets[SQLCACHE_BUCKETS];
+  sqlentry_t *oldest;  /* evicted first */
+  sqlentry_t *newest;
+  long bytes;          /* the size of all entries */
+  pthread_mutex_t lock;
+  volatile long gen;  /* bumped on every invalidation */
+  PGconn *listener;   /* LISTENs on SQLCACHE_CHANNEL */
+
+  /* told of every invalidation, NULL table for all of them */
+  void (*changed)(void *arg, const char *table);
+  void *changed_arg;
+};
+
+
+sqlcache_t *sqlcache_new();
+
+void sqlcache_destroy(sqlcache_t *cache);
+
+int sqlcache_key(char *key,
+                 const sqlobj_t *sqlo);
+
+sqlentry_t *sqlcache_get(sqlcache_t *cache,
+                         const char *key);
+
+void sqlcache_release(sqlentry_t *entry);
+
+void sqlcache_put(sqlcache_t *cache,
+                  const char *key,
+                  const char *table,
+                  char *body,
+                  const int len_body,
+                  const long gen);
+
+void sqlcache_invalidate(sqlcache_t *cache,
+                         const char *table);
+
+void sqlcache_expire(sqlcache_t *cache);
+
+int sqlcache_listen(sqlcache_t *cache,
+                    const char *conninfo,
+                    const char *schema);
+
+void sqlcache_notified(sqlcache_t *cache);
+
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libpq-fe.h>
+#include "json.h"
+#include "pg_conn.h"
+#include "sqlobj.h"
+#include "sqlops.h"
+#include "snapshot.h"
+#include "backend.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+#define MOCK_TABLES 32
+#define MOCK_COLS 64
+
+
+/*
+ * the tables of a fixture file, in the text format of COPY:
+ *
+ *   # a comment
+ *   table users id:int4 name:text email:text
+ *   1<TAB>alice<TAB>alice@example.com
+ *   2<TAB>bob<TAB>\N
+ *
+ * a "table" line starts a table, each row has a value for every column,
+ * \N is null and \t, \n, \\ are escapes;
+ * the SELECTs are answered by the snapshot engine, so they are limited to
+ * its projections and simple conditions, and no rows are ever written
+ */
+typedef struct _mockdb {
+  snaptab_t *tabs[MOCK_TABLES];
+  int ntabs;
+} mockdb_t;
+
+
+static Oid _type(const char *name)
+{
+  static const struct { const char *name; Oid oid; } types[] = {
+    { "int2", OID_INT2 }, { "int4", OID_INT4 }, { "int8", OID_INT8 },
+    { "float4", OID_FLOAT4 }, { "float8", OID_FLOAT8 },
+    { "numeric", OID_NUMERIC }, { "text", OID_TEXT },
+    { "varchar", OID_VARCHAR }, { "name", OID_NAME },
+    { "bpchar", OID_BPCHAR }, { "timestamp", OID_TIMESTAMP }
+  };
+  unsigned i;
+  for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    if (strcmp(types[i].name, name) == 0) return types[i].oid;
+  return OID_TEXT;
+}
+
+/* "table <name> <col>:<type> ...", the columns of a result to be */
+static PGresult *_table(char *line,
+                        char *table)
+{
+  PGresAttDesc cols[MOCK_COLS];
+  char *save;
+  int n = 0;
+
+  strtok_r(line, " \t\r\n", &save);
+  char *name = strtok_r(NULL, " \t\r\n", &save);
+  if (!name || strlen(name) > 16) return NULL;
+  strcpy(table, name);
+
+  char *col;
+  while ((col = strtok_r(NULL, " \t\r\n", &save)) && n < MOCK_COLS) {
+    char *type = strchr(col, ':');
+    if (type) *type++ = '\0';
+    memset(&cols[n], 0, sizeof(PGresAttDesc));
+    cols[n].name = col;
+    cols[n].typid = _type(type ? type : "text");
+    cols[n].typlen = -1;
+    cols[n].atttypmod = -1;
+    n++;
+  }
+
+  PGresult *res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  if (!PQsetResultAttrs(res, n, cols)) {
+    PQclear(res);
+    return NULL;
+  }
+  return res;
+}
+
+/* undo the escapes of a value in place, returns its length */
+static int _unescape(char *v)
+{
+  char *in = v;
+  char *out = v;
+  while (*in) {
+    if (*in == '\\' && in[1]) {
+      in++;
+      *out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in == 'r' ? '\r' : *in;
+      in++;
+    }
+    else
+      *out++ = *in++;
+  }
+  *out = '\0';
+  return out - v;
+}
+
+/* a row has a value for each column, no more and no less */
+static int _row(PGresult *res,
+                char *line)
+{
+  int tup = PQntuples(res);
+  int ncols = PQnfields(res);
+  int j;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  for (j = 0; j < ncols; j++) {
+    char *v = line;
+    char *tab = strchr(line, '\t');
+    if (!tab != (j == ncols - 1)) return 0;
+    if (tab) *tab = '\0';
+    line = tab ? tab + 1 : line + strlen(line);
+
+    int ok = strcmp(v, "\\N") == 0 ?
+             PQsetvalue(res, tup, j, NULL, -1) :
+             PQsetvalue(res, tup, j, v, _unescape(v));
+    if (!ok) return 0;
+  }
+  return 1;
+}
+
+static void _add(mockdb_t *db,
+                 const char *table,
+                 PGresult *res)
+{
+  if (!res) return;
+  if (db->ntabs < MOCK_TABLES) {
+    db->tabs[db->ntabs++] = snaptab_new(table, res);
+    D_PRINT("[MOCK] %s, %d rows\n", table, PQntuples(res));
+  }
+  PQclear(res);
+}
+
+static mockdb_t *_load(const char *fixture)
+{
+  FILE *f = fopen(fixture, "r");
+  if (!f) {
+    perror(fixture);
+    return NULL;
+  }
+
+  mockdb_t *db = calloc(1, sizeof(struct _mockdb));
+  PGresult *res = NULL;
+  char table[17];
+  char *line = NULL;
+  size_t cap = 0;
+  int no = 0;
+  int bad = 0;
+
+  while (!bad && getline(&line, &cap, f) != -1) {
+    no++;
+    if (line[0] == '#' || line[0] == '\n') continue;
+    if (strncmp(line, "table ", 6) == 0) {
+      _add(db, table, res);
+      res = _table(line, table);
+      bad = !res;
+    }
+    else
+      bad = !res || !_row(res, line);
+  }
+  /* half a fixture makes a misleading benchmark, so the load fails */
+  if (bad) {
+    fprintf(stderr, "%s:%d: bad %s\n", fixture, no, res ? "row" : "table");
+    if (res) PQclear(res);
+    int i;
+    for (i = 0; i < db->ntabs; i++) snaptab_release(db->tabs[i]);
+    free(db);
+    db = NULL;
+  }
+  else
+    _add(db, table, res);
+
+  free(line);
+  fclose(f);
+  return db;
+}
+
+static snaptab_t *_find(const mockdb_t *db,
+                        const char *table)
+{
+  int i;
+  for (i = 0; i < db->ntabs; i++)
+    if (strcmp(db->tabs[i]->table, table) == 0) return db->tabs[i];
+  return NULL;
+}
+
+/* the rows are at hand, resume() serializes them batch after batch */
+static int _mock_query(backend_t *be,
+                       sqlreq_t *q,
+                       const long wait)
+{
+  q->op = 0;
+  return SQL_MORE;
+}
+
+static int _mock_resume(backend_t *be,
+                        sqlreq_t *q)
+{
+  mockdb_t *db = (mockdb_t *)be->db;
+
+  while (q->op < q->nsqlo) {
+    if (!q->cursor) {
+      snaptab_t *t = _find(db, q->sqlo[q->op]->table);
+      q->cursor = t ? snapscan_new(t, q->sqlo[q->op]) : NULL;
+      if (!q->cursor) return SQL_ERROR;
+      if (q->array) json_puts(&q->out, q->op ? "," : "[");
+    }
+    if (!snapscan_rows(q->cursor, &q->out, q->batch)) return SQL_MORE;
+    snapscan_destroy(q->cursor);
+    q->cursor = NULL;
+    q->op++;
+  }
+
+  if (q->array) json_puts(&q->out, "]");
+  return SQL_DONE;
+}
+
+static int _mock_socket(sqlreq_t *q)
+{
+  return -1;
+}
+
+static int _mock_flush(sqlreq_t *q)
+{
+  return 0;
+}
+
+static PGcancel *_mock_cancel(sqlreq_t *q)
+{
+  return NULL;
+}
+
+static void _mock_release(backend_t *be,
+                          sqlreq_t *q)
+{
+  if (q->cursor) snapscan_destroy(q->cursor);
+  q->cursor = NULL;
+}
+
+static void _mock_close(backend_t *be)
+{
+  mockdb_t *db = (mockdb_t *)be->db;
+  int i;
+  for (i = 0; i < db->ntabs; i++) snaptab_release(db->tabs[i]);
+  free(db);
+}
+
+/* in-process tables for benchmarking the POST path, NULL if unreadable
+ * or malformed */
+backend_t *backend_mock(const char *fixture)
+{
+  mockdb_t *db = _load(fixture);
+  if (!db) return NULL;
+
+  backend_t *be = calloc(1, sizeof(struct _backend));
+  be->name = "mock";
+  be->db = db;
+  be->query = _mock_query;
+  be->export = NULL;
+  be->resume = _mock_resume;
+  be->socket = _mock_socket;
+  be->flush = _mock_flush;
+  be->cancel = _mock_cancel;
+  be->release = _mock_release;
+  be->close = _mock_close;
+  return be;
+}
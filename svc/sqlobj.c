@@ -7,7 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "memcpy_sse2.h"
+#include "arena.h"
 #include "jsmn.h"
 #include "sqlobj.h"
 
@@ -15,9 +15,16 @@
 #include "debug.h"
 
 
-sqlobj_t *sqlobj_new()
+/* an empty object, its arena has room for size more bytes */
+sqlobj_t *sqlobj_new(const size_t size)
 {
-  sqlobj_t *sqlo = calloc(1, sizeof(struct _sqlobj));
+  arena_t *arena = arena_new(sizeof(struct _sqlobj) + size);
+  if (!arena) return NULL;
+
+  sqlobj_t *sqlo = arena_alloc(arena, sizeof(struct _sqlobj));
+  memset(sqlo, 0, sizeof(struct _sqlobj));
+  sqlo->arena = arena;
+  sqlo->table = sqlo->cmd = sqlo->qfield = sqlo->clause = "";
   sqlo->viscols = 1;
 
   return sqlo;
@@ -25,100 +32,398 @@ sqlobj_t *sqlobj_new()
 
 void sqlobj_destroy(sqlobj_t *sqlo)
 {
-  int i = 0;
-  do {
-    if (sqlo->keys[i]) free(sqlo->keys[i]);
-    if (sqlo->values[i]) free(sqlo->values[i]);
-    i++;
-  } while (i < sqlo->nkeys);
-  free(sqlo);
+  arena_destroy(sqlo->arena);
 }
 
-sqlobj_t *sql_parse_json(const char *body,
-                         const size_t len_body)
+/*
+ * a json string in place, js holds the text from offset off of the body;
+ * its closing quote gives way to the terminating '\0'
+ */
+static char *_slice(char *js,
+                    const int off,
+                    const jsmntok_t *t)
 {
-  sqlobj_t *sqlo = sqlobj_new();
-  if (!sqlo) return NULL;
+  js[t->end - off] = '\0';
+  return js + t->start - off;
+}
 
-  jsmntok_t t[MAX_JSMN_TOKENS];  /* MAX_JSMN_TOKENS = 128 */
-  jsmntok_t *g;
-  jsmn_parser_t p;
+static int _hex4(const char *s)
+{
+  int i, v = 0;
+  for (i = 0; i < 4; i++) {
+    char c = s[i];
+    if (c >= '0' && c <= '9') v = v * 16 + c - '0';
+    else if (c >= 'a' && c <= 'f') v = v * 16 + c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') v = v * 16 + c - 'A' + 10;
+    else return -1;
+  }
+  return v;
+}
 
-  jsmn_init(&p);
-  int n = jsmn_parse(&p, body, len_body, t, MAX_JSMN_TOKENS);
-  D_PRINT("[SQL] n_toks: %d\n", n);
+static char *_utf8(char *q,
+                   const unsigned int cp)
+{
+  if (cp < 0x80) *q++ = cp;
+  else if (cp < 0x800) {
+    *q++ = 0xc0 | cp >> 6;
+    *q++ = 0x80 | (cp & 0x3f);
+  }
+  else if (cp < 0x10000) {
+    *q++ = 0xe0 | cp >> 12;
+    *q++ = 0x80 | (cp >> 6 & 0x3f);
+    *q++ = 0x80 | (cp & 0x3f);
+  }
+  else {
+    *q++ = 0xf0 | cp >> 18;
+    *q++ = 0x80 | (cp >> 12 & 0x3f);
+    *q++ = 0x80 | (cp >> 6 & 0x3f);
+    *q++ = 0x80 | (cp & 0x3f);
+  }
+  return q;
+}
+
+/* the escapes of a json string decoded in place, it never grows */
+static char *_unescape(char *s)
+{
+  char *p = s;
+  char *q = s;
+  int cp, lo;
+
+  while (*p) {
+    if (*p != '\\') {
+      *q++ = *p++;
+      continue;
+    }
+    p++;
+    switch (*p) {
+      case 'b': *q++ = '\b'; p++; break;
+      case 'f': *q++ = '\f'; p++; break;
+      case 'n': *q++ = '\n'; p++; break;
+      case 'r': *q++ = '\r'; p++; break;
+      case 't': *q++ = '\t'; p++; break;
+      case 'u':
+        if ((cp = _hex4(p + 1)) < 0) return NULL;
+        p += 5;
+        /* a surrogate pair makes one code point */
+        if (cp >= 0xd800 && cp < 0xdc00 && p[0] == '\\' && p[1] == 'u' &&
+            (lo = _hex4(p + 2)) >= 0xdc00 && lo < 0xe000) {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          p += 6;
+        }
+        if (cp >= 0xd800 && cp < 0xe000) return NULL;
+        if (!cp) return NULL;  /* no NUL in a text parameter */
+        q = _utf8(q, cp);
+        break;
+      case '\0':
+        return NULL;
+      default:
+        *q++ = *p++;  /* " \ / */
+    }
+  }
+  *q = '\0';
+  return s;
+}
+
+/*
+ * a value: a string is decoded, null is NULL (SQL NULL), a number or a
+ * boolean stays as its text
+ */
+static char *_slice_value(char *js,
+                          const int off,
+                          const jsmntok_t *t,
+                          int *bad)
+{
+  char *v = _slice(js, off, t);
+  if (t->type == JSMN_STRING) {
+    if (!_unescape(v)) *bad = 1;
+    return v;
+  }
+  if (t->type != JSMN_PRIMITIVE) {
+    *bad = 1;
+    return v;
+  }
+  return strcmp(v, "null") == 0 ? NULL : v;
+}
+
+static int _eq(const char *js,
+               const int off,
+               const jsmntok_t *t,
+               const char *s)
+{
+  return jsoneq(js - off, t, s);
+}
+
+/* the values of a json array, count is -1 if one can't be a parameter */
+static char **_slice_array(sqlobj_t *sqlo,
+                           char *js,
+                           const int off,
+                           const jsmntok_t *t,
+                           const int n,
+                           int *count)
+{
+  int j, bad = 0;
+  char **dst = arena_alloc(sqlo->arena, (t->size + 1) * sizeof(char *));
+  if (!dst) return NULL;
+
+  *count = 0;
+  for (j = 0; j < t->size && j + 1 < n; j++) {
+    dst[j] = _slice_value(js, off, &t[j + 1], &bad);
+    D_PRINT("[SQL] %s\n", dst[j] ? dst[j] : "(null)");
+    (*count)++;
+  }
+  dst[j] = NULL;
+  if (bad) *count = -1;
+  return dst;
+}
+
+/* the column = value pairs of a json object, for the where of a write */
+static void _slice_where(sqlobj_t *sqlo,
+                         char *js,
+                         const int off,
+                         const jsmntok_t *t,
+                         const int n)
+{
+  int j, bad = 0;
+  sqlo->wkeys = arena_alloc(sqlo->arena, (t->size + 1) * sizeof(char *));
+  sqlo->wvalues = arena_alloc(sqlo->arena, (t->size + 1) * sizeof(char *));
+  if (!sqlo->wkeys || !sqlo->wvalues) {
+    sqlo->nwhere = -1;
+    return;
+  }
+
+  for (j = 0; j < t->size && 2 * j + 2 < n; j++) {
+    if (t[2 * j + 1].type != JSMN_STRING) bad = 1;
+    sqlo->wkeys[j] = _slice(js, off, &t[2 * j + 1]);
+    sqlo->wvalues[j] = _slice_value(js, off, &t[2 * j + 2], &bad);
+  }
+  sqlo->wkeys[j] = sqlo->wvalues[j] = NULL;
+  sqlo->nwhere = bad || j < t->size ? -1 : j;
+}
 
+/*
+ * the keys of an object, the tokens from first to n; js holds the body
+ * from offset off, a slice only cuts into the text after its own token
+ */
+static void _parse_obj(sqlobj_t *sqlo,
+                       char *js,
+                       const int off,
+                       const jsmntok_t *t,
+                       const int first,
+                       const int n)
+{
   /* Loop over all keys */
-  int i, j;
-  for (i = 1; i < n; i++) {
-    int len = 0;
-    int count = 0;
-
-    if (jsoneq(body, &t[i], "table") == 0) {
-      len =  t[i + 1].end - t[i + 1].start;
-      memcpy_fast(sqlo->table, body + t[i + 1].start, len);
-      sqlo->table[len] = '\0';
-      i++;
+  int i;
+  for (i = first + 1; i + 1 < n; i++) {
+    if (_eq(js, off, &t[i], "table") == 0) {
+      sqlo->table = _slice(js, off, &t[++i]);
       D_PRINT("[SQL] table: %s\n", sqlo->table);
     }
-    else if (jsoneq(body, &t[i], "cmd") == 0) {
-      len =  t[i + 1].end - t[i + 1].start;
-      memcpy_fast(sqlo->cmd, body + t[i + 1].start, len);
-      sqlo->cmd[len] = '\0';
-      i++;
+    else if (_eq(js, off, &t[i], "cmd") == 0) {
+      sqlo->cmd = _slice(js, off, &t[++i]);
       D_PRINT("[SQL] cmd: %s\n", sqlo->cmd);
     }
-    else if (jsoneq(body, &t[i], "clause") == 0) {
-      len =  t[i + 1].end - t[i + 1].start;
-      memcpy_fast(sqlo->clause, body + t[i + 1].start, len);
-      sqlo->clause[len] = '\0';
-      i++;
+    else if (_eq(js, off, &t[i], "clause") == 0) {
+      sqlo->clause = _slice(js, off, &t[++i]);
       D_PRINT("[SQL] clause: %s\n", sqlo->clause);
     }
-    else if (jsoneq(body, &t[i], "viscols") == 0) {
-      sqlo->viscols = atoi(body + t[i + 1].start);
+    else if (_eq(js, off, &t[i], "viscols") == 0) {
+      sqlo->viscols = atoi(js + t[i + 1].start - off);
       i++;
       D_PRINT("[SQL] viscols %d\n", sqlo->viscols);
     }
 
     /* keys - json array */
-    else if (jsoneq(body, &t[i], "keys") == 0) {
+    else if (_eq(js, off, &t[i], "keys") == 0) {
       if (t[i + 1].type != JSMN_ARRAY) {
         /* We expect keys to be an array of strings */
         continue;
       }
-      for (j = 0; j < t[i + 1].size; j++) {
-        g = &t[i + j + 2];
-        len = g->end - g->start;
-        sqlo->keys[count] = malloc(len + 1);
-        memcpy_fast(sqlo->keys[count], body + g->start, len);
-        sqlo->keys[count][len] = '\0';
-        D_PRINT("[SQL] key: %s\n", sqlo->keys[count]);
-        count++;
-      }
+      sqlo->keys = _slice_array(sqlo, js, off, &t[i + 1], n - i - 1,
+                                &sqlo->nkeys);
       i += t[i + 1].size + 1;
-      count = 0;  /* reset counter */
     }
     /* values - json array */
-    else if (jsoneq(body, &t[i], "values") == 0) {
+    else if (_eq(js, off, &t[i], "values") == 0) {
       if (t[i + 1].type != JSMN_ARRAY) {
-        /* We expect keys to be an array of strings */
+        /* We expect values to be an array of strings */
         continue;
       }
-      for (j = 0; j < t[i + 1].size; j++) {
-        g = &t[i + j + 2];
-        len = g->end - g->start;
-        sqlo->values[count] = malloc(len + 1);
-        memcpy_fast(sqlo->values[count], body + g->start, len);
-        sqlo->values[count][len] = '\0';
-        D_PRINT("[SQL] value: %s\n", sqlo->values[count]);
-        count++;
-      }
+      sqlo->values = _slice_array(sqlo, js, off, &t[i + 1], n - i - 1,
+                                  &sqlo->nvalues);
       i += t[i + 1].size + 1;
-      sqlo->nkeys = count;
+    }
+    /* where - json object of columns and values */
+    else if (_eq(js, off, &t[i], "where") == 0) {
+      if (t[i + 1].type != JSMN_OBJECT) {
+        sqlo->nwhere = -1;
+        continue;
+      }
+      _slice_where(sqlo, js, off, &t[i + 1], n - i - 1);
+      i += 2 * t[i + 1].size + 1;
     }
   }
+}
+
+/*
+ * the body is copied once into the arena of the object, the tokens are
+ * taken from there as well, as many as the body needs
+ */
+sqlobj_t *sql_parse_json(const char *body,
+                         const size_t len_body)
+{
+  sqlobj_t *sqlo = sqlobj_new(len_body + 1 +
+                              MAX_JSMN_TOKENS * sizeof(jsmntok_t));
+  if (!sqlo) return NULL;
+
+  char *js = arena_strndup(sqlo->arena, body, len_body);
+  jsmntok_t *t;
+  jsmn_parser_t p;
+
+  jsmn_init(&p);
+  int n = jsmn_parse_grow(&p, js, len_body, sqlo->arena, &t);
+  D_PRINT("[SQL] n_toks: %d\n", n);
+
+  _parse_obj(sqlo, js, 0, t, 0, n);
   D_PRINT("[SQL] nkeys: %d\n", sqlo->nkeys);
 
   return sqlo;
 }
+
+sqlstream_t *sql_stream_new()
+{
+  sqlstream_t *s = calloc(1, sizeof(struct _sqlstream));
+  if (!s) return NULL;
+  s->scan = malloc(sizeof(struct _jsmnscan));
+  if (!s->scan) {
+    free(s);
+    return NULL;
+  }
+  s->state = SQL_STREAM_MORE;
+  return s;
+}
+
+void sql_stream_destroy(sqlstream_t *s)
+{
+  if (s->elem) free(s->elem);
+  free(s->scan);
+  free(s);
+}
+
+static int _space(const char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static int _stream_keep(sqlstream_t *s,
+                        const char *bytes,
+                        const size_t len)
+{
+  if (s->len + len > s->size) {
+    if (s->len + len > SQL_STREAM_ELEM_MAX) return 0;
+    size_t size = s->size ? s->size : 1024;
+    while (size < s->len + len) size *= 2;
+    char *elem = realloc(s->elem, size);
+    if (!elem) return 0;
+    s->elem = elem;
+    s->size = size;
+  }
+  memcpy(s->elem + s->len, bytes, len);
+  s->len += len;
+  return 1;
+}
+
+/*
+ * the object goes on with bytes, its index tells whether it closes in
+ * them; returns how many of them it takes, all of them if it is still
+ * open, 0 on error
+ */
+static size_t _stream_elem(sqlstream_t *s,
+                           const char *bytes,
+                           const size_t len)
+{
+  size_t kept = s->len;
+  size_t at;
+
+  if (!_stream_keep(s, bytes, len)) return 0;
+  jsmn_scan_more(s->scan, s->elem, s->len);
+
+  /* only the brackets matter, whatever is in a string is not there */
+  for (at = s->from; (at = jsmn_scan_nest(s->scan, at)) < s->len; at++) {
+    char c = s->elem[at];
+    if (c == '{' || c == '[') s->depth++;
+    else if ((c == '}' || c == ']') && --s->depth == 1) break;
+  }
+  if (at == s->len) {
+    s->from = at;
+    return len;
+  }
+  s->len = at + 1;
+  return s->len - kept;
+}
+
+/*
+ * the brackets outside the strings tell where an object ends, then jsmn
+ * gets the object whole: with its relaxed primitives it can't tell a
+ * number cut by the network from a complete one; returns SQL_STREAM_xxx
+ */
+int sql_stream_feed(sqlstream_t *s,
+                    const char *bytes,
+                    const size_t len,
+                    sqls_elem_fn fn,
+                    void *arg)
+{
+  size_t i = 0;
+  size_t n;
+
+  while (i < len && s->state == SQL_STREAM_MORE) {
+    char c = bytes[i];
+
+    /* between the objects */
+    if (s->depth < 2) {
+      i++;
+      if (_space(c)) continue;
+      if (s->depth == 0 && c == '[') s->depth = 1;
+      else if (s->depth == 1 && c == ',' && s->nelems) continue;
+      else if (s->depth == 1 && c == ']') s->state = SQL_STREAM_END;
+      else if (s->depth == 1 && c == '{') {
+        s->depth = 2;
+        s->len = 0;
+        _stream_keep(s, &c, 1);
+        jsmn_scan_init(s->scan, s->elem, s->len);
+        s->from = 1;
+      }
+      else
+        s->state = SQL_STREAM_ERROR;
+      continue;
+    }
+
+    /*
+     * a step as long as the object so far: the bytes copied past its end
+     * stay below twice its length, however many objects the chunk holds
+     */
+    n = s->len > 64 ? s->len : 64;
+    if (n > len - i) n = len - i;
+    if (n > SQL_STREAM_ELEM_MAX - s->len) n = SQL_STREAM_ELEM_MAX - s->len;
+    n = _stream_elem(s, bytes + i, n);
+    if (!n) {
+      s->state = SQL_STREAM_ERROR;
+      break;
+    }
+    i += n;
+    if (s->depth == 1) {
+      sqlobj_t *sqlo = sql_parse_json(s->elem, s->len);
+      if (!sqlo) {
+        s->state = SQL_STREAM_ERROR;
+        break;
+      }
+      s->nelems++;
+      D_PRINT("[SQL] element %d of the stream\n", s->nelems);
+      fn(arg, sqlo);
+    }
+  }
+  /* anything after the array is an error as well */
+  for (; i < len && s->state == SQL_STREAM_END; i++)
+    if (!_space(bytes[i])) s->state = SQL_STREAM_ERROR;
+
+  return s->state;
+}
@@ -8,29 +8,72 @@
 #define _SQLOBJ_
 
 
-#define MAX_SQL_KEYS 32
+#define SQL_STREAM_ELEM_MAX 1048576  /* bytes, the longest element */
+
+#define SQL_STREAM_MORE 0   /* the array goes on */
+#define SQL_STREAM_END 1    /* it is closed */
+#define SQL_STREAM_ERROR -1
 
 
 typedef struct _sqlobj sqlobj_t;
 
+/*
+ * the strings are slices of a copy of the request body, they live in the
+ * arena of the object along with it, "" if the request has none
+ */
 struct _sqlobj {
-  char table[17];
-  char cmd[7];  /* SELECT, INSERT, UPDATE, DELETE */
-  char qfield[128];  /* query fields */
-  char clause[128];  /* where clasue */
-  char *keys[MAX_SQL_KEYS];
-  char *values[MAX_SQL_KEYS];
+  struct _arena *arena;
+  char *table;
+  char *cmd;  /* SELECT, INSERT, UPDATE, DELETE */
+  char *qfield;  /* query fields */
+  char *clause;  /* where clasue */
+  char **keys;
+  char **values;   /* decoded, NULL for a json null */
   int nkeys;
+  int nvalues;     /* -1 if one is not a string, number, bool or null */
+  char **wkeys;    /* "where": {"col": value, ...} of an UPDATE or DELETE */
+  char **wvalues;
+  int nwhere;      /* -1 if it is malformed */
   int viscols;  /* field name visibility */
 };
 
 
-sqlobj_t *sqlobj_new();
+sqlobj_t *sqlobj_new(const size_t size);
 
 void sqlobj_destroy(sqlobj_t *sqlo);
 
 sqlobj_t *sql_parse_json(const char *body,
                          const size_t len_body);
 
+typedef void (*sqls_elem_fn)(void *arg, sqlobj_t *sqlo);
+
+/*
+ * a json array of objects read as it arrives: the bytes are fed as they
+ * come, each object is parsed and handed over as soon as it closes, only
+ * the one being read is kept
+ */
+typedef struct _sqlstream sqlstream_t;
+
+struct _sqlstream {
+  char *elem;    /* the bytes of the object not closed yet */
+  size_t len;
+  size_t size;
+  int depth;     /* 0 before the array, 1 between its objects */
+  struct _jsmnscan *scan;  /* where the brackets of elem are */
+  size_t from;   /* where it is read next */
+  int state;     /* SQL_STREAM_xxx */
+  int nelems;
+};
+
+sqlstream_t *sql_stream_new();
+
+void sql_stream_destroy(sqlstream_t *s);
+
+int sql_stream_feed(sqlstream_t *s,
+                    const char *bytes,
+                    const size_t len,
+                    sqls_elem_fn fn,
+                    void *arg);
+
 
 #endif
@@ -7,9 +7,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 #include <libpq-fe.h>
 #include "io.h"
 #include "util.h"
+#include "json.h"
 #include "pg_conn.h"
 #include "sqlobj.h"
 #include "sqlops.h"
@@ -18,9 +21,15 @@
 #include "debug.h"
 
 
-void _prep_select(char *sql,
-                  const sqlobj_t *sqlo)
+/* the sql of a SELECT, 0 if it is longer than size */
+int _prep_select(char *sql,
+                 const size_t size,
+                 const sqlobj_t *sqlo)
 {
+  size_t need = 16 + strlen(sqlo->qfield) + strlen(sqlo->table) +
+                strlen(sqlo->clause);
+  if (need > size) return 0;
+
   char *ret = strbld(sql, "SELECT ");
   if (sqlo->qfield[0]) {
     ret = strbld(ret, sqlo->qfield);
@@ -33,189 +42,611 @@ void _prep_select(char *sql,
 
   if (sqlo->clause[0]) ret = strbld(ret, sqlo->clause);
   *ret++ = '\0';
+  return 1;
 }
 
-void _parse_result(char *res,
-                   PGresult *pgres,
-                   const int viscols)
-{
-  int i, j;
-
-  int nFields = PQnfields(pgres);
-  char *ret = strbld(res, "{");
-  /* show attribute names? */
-  if (viscols) {
-    ret = strbld(ret, "\"h\":{\"hd\":[");
-    for (i = 0; i < nFields; i++) {
-      ret = strbld(ret, "\"");
-      ret = strbld(ret, PQfname(pgres, i));
-      if (i != nFields - 1)
-        ret = strbld(ret, "\",");
-      else
-        ret = strbld(ret, "\"]},");
+#define PG_EPOCH_DAYS 10957  /* 2000-01-01 - 1970-01-01 */
+
+
+/*
+ * the result format of a statement, binary when every column can be
+ * decoded here; text columns are the same bytes either way
+ */
+static int _result_format(const PGresult *pgres)
+{
+  int i;
+  for (i = 0; i < PQnfields(pgres); i++) {
+    switch (PQftype(pgres, i)) {
+      case OID_INT2: case OID_INT4: case OID_INT8:
+      case OID_FLOAT4: case OID_FLOAT8: case OID_TIMESTAMP:
+      case OID_TEXT: case OID_NAME: case OID_BPCHAR: case OID_VARCHAR:
+        break;
+      default:
+        return 0;
     }
   }
+  return 1;
+}
 
-  /* next, show the row values */
-  int nRows = PQntuples(pgres);
-  for (i = 0; i < nRows; i++) {
-    if (i == 0)
-      ret = strbld(ret, "\"d\":{\"r");
-    else
-      ret = strbld(ret, "\"r");
-
-    char tmp[64];
-    sprintf(tmp, "%03d", i);
-    ret = strbld(ret, tmp);
-    ret = strbld(ret, "\":[");
-
-    for (j = 0; j < nFields; j++) {
-      *ret++ = '"';
-      ret = strbld(ret, PQgetvalue(pgres, i, j));
-      if (j != nFields - 1)
-        ret = strbld(ret, "\",");
-      else {
-        if (i != nRows - 1)
-          ret = strbld(ret, "\"],");
-        else
-          ret = strbld(ret, "\"]}");
+static unsigned long _be(const unsigned char *p,
+                         const int n)
+{
+  unsigned long v = 0;
+  int i;
+  for (i = 0; i < n; i++) v = (v << 8) | p[i];
+  return v;
+}
+
+/* the text output of postgres, YYYY-MM-DD HH:MM:SS[.ffffff] [BC] */
+static void _put_timestamp(jsonbuf_t *jb,
+                           const long usecs)
+{
+  if (usecs == 0x7fffffffffffffffL) {
+    json_puts(jb, "\"infinity\"");
+    return;
+  }
+  if (usecs == -0x7fffffffffffffffL - 1) {
+    json_puts(jb, "\"-infinity\"");
+    return;
+  }
+
+  long secs = usecs / 1000000;
+  long frac = usecs % 1000000;
+  if (frac < 0) {
+    frac += 1000000;
+    secs--;
+  }
+  long days = secs / 86400;
+  long tod = secs % 86400;
+  if (tod < 0) {
+    tod += 86400;
+    days--;
+  }
+
+  /* civil date from days since 1970-01-01 */
+  long z = days + PG_EPOCH_DAYS + 719468;
+  long era = (z >= 0 ? z : z - 146096) / 146097;
+  long doe = z - era * 146097;
+  long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long mp = (5 * doy + 2) / 153;
+  long d = doy - (153 * mp + 2) / 5 + 1;
+  long m = mp < 10 ? mp + 3 : mp - 9;
+  long y = yoe + era * 400 + (m <= 2);
+  int bc = y <= 0;
+  if (bc) y = 1 - y;
+
+  json_put(jb, "\"", 1);
+  json_put_long(jb, y, 4);
+  json_put(jb, "-", 1);
+  json_put_long(jb, m, 2);
+  json_put(jb, "-", 1);
+  json_put_long(jb, d, 2);
+  json_put(jb, " ", 1);
+  json_put_long(jb, tod / 3600, 2);
+  json_put(jb, ":", 1);
+  json_put_long(jb, tod / 60 % 60, 2);
+  json_put(jb, ":", 1);
+  json_put_long(jb, tod % 60, 2);
+  if (frac) {
+    int width = 6;
+    while (frac % 10 == 0) {
+      frac /= 10;
+      width--;
+    }
+    json_put(jb, ".", 1);
+    json_put_long(jb, frac, width);
+  }
+  if (bc) json_put(jb, " BC", 3);
+  json_put(jb, "\"", 1);
+}
+
+/* a binary value of the types _result_format() accepts */
+static void _put_binary(jsonbuf_t *jb,
+                        const Oid type,
+                        const unsigned char *v,
+                        const int n)
+{
+  union { unsigned long u; double d; } f8;
+  union { unsigned u; float f; } f4;
+
+  switch (type) {
+    case OID_INT2:
+      json_put_long(jb, (short)_be(v, 2), 0);
+      return;
+    case OID_INT4:
+      json_put_long(jb, (int)_be(v, 4), 0);
+      return;
+    case OID_INT8:
+      json_put_long(jb, (long)_be(v, 8), 0);
+      return;
+    case OID_FLOAT4:
+      f4.u = _be(v, 4);
+      json_put_float(jb, f4.f);
+      return;
+    case OID_FLOAT8:
+      f8.u = _be(v, 8);
+      json_put_double(jb, f8.d);
+      return;
+    case OID_TIMESTAMP:
+      _put_timestamp(jb, (long)_be(v, 8));
+      return;
+  }
+  json_put_str(jb, (const char *)v, n);
+}
+
+/* a text value, numbers are json numbers as in the binary format */
+void sql_put_text(jsonbuf_t *jb,
+                  const Oid type,
+                  const char *v,
+                  const int n)
+{
+  switch (type) {
+    case OID_INT2: case OID_INT4: case OID_INT8:
+      json_put(jb, v, n);
+      return;
+    case OID_FLOAT4: case OID_FLOAT8: case OID_NUMERIC:
+      /* NaN and Infinity stay strings */
+      if (n && (v[0] == '-' || (v[0] >= '0' && v[0] <= '9')) &&
+          v[n - 1] >= '0' && v[n - 1] <= '9') {
+        json_put(jb, v, n);
+        return;
       }
+  }
+  json_put_str(jb, v, n);
+}
+
+/* the json opening, with the attribute names if they are visible */
+static void _put_head(sqlreq_t *q,
+                      const sqlobj_t *sqlo,
+                      const PGresult *pgres)
+{
+  int i;
+  int nfields = PQnfields(pgres);
+
+  json_puts(&q->out, "{");
+  if (sqlo->viscols) {
+    json_puts(&q->out, "\"h\":{\"hd\":[");
+    for (i = 0; i < nfields; i++) {
+      if (i) json_puts(&q->out, ",");
+      const char *name = PQfname(pgres, i);
+      json_put_str(&q->out, name, strlen(name));
     }
+    json_puts(&q->out, "]},");
   }
-  *ret++ = '}';
-  *ret++ = '\0';
-  PQclear(pgres);
+  json_puts(&q->out, "\"d\":{");
 }
 
-void sql_select(char *res,
-                PGconn *pgconn,
-                const sqlobj_t *sqlo)
+/* tuple tup of the result, as the n-th row of the json */
+static void _put_row(sqlreq_t *q,
+                     const PGresult *pgres,
+                     const int tup,
+                     const long n)
 {
-  char sql[256];
-  _prep_select(sql, sqlo);
+  int j;
+  int nfields = PQnfields(pgres);
 
-  /* Start a transaction block */
-  PGresult *pgres = PQexec(pgconn, "BEGIN");
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("BEGIN command failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
+  json_puts(&q->out, n ? ",\"r" : "\"r");
+  json_put_long(&q->out, n, 3);
+  json_puts(&q->out, "\":[");
+  for (j = 0; j < nfields; j++) {
+    if (j) json_puts(&q->out, ",");
+    const char *v = PQgetvalue(pgres, tup, j);
+    int len = PQgetlength(pgres, tup, j);
+    if (PQgetisnull(pgres, tup, j))
+      json_puts(&q->out, "null");
+    else if (PQfformat(pgres, j))
+      _put_binary(&q->out, PQftype(pgres, j), (const unsigned char *)v, len);
+    else
+      sql_put_text(&q->out, PQftype(pgres, j), v, len);
   }
-  PQclear(pgres);
+  json_puts(&q->out, "]");
+}
 
-  /* prepare statement name */
-  const char *stmt = "prep_select";
-  pgres = PQprepare(pgconn,
-                    stmt,
-                    sql,
-                    0,
-                    NULL);
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("PREPARE failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
+sqlreq_t *sqlreq_new(pgslot_t *slot,
+                     const int batch)
+{
+  sqlreq_t *q = calloc(1, sizeof(struct _sqlreq));
+  q->slot = slot;
+  q->step = SQL_STEP_PREPARE;
+  q->batch = batch;
+  json_init(&q->out, batch ? batch + SQL_ROW_SIZE : SQL_BUF_SIZE);
+  return q;
+}
+
+/* the request owns the query from now on */
+void sqlreq_add(sqlreq_t *q,
+                sqlobj_t *sqlo)
+{
+  if (q->nsqlo < SQL_BATCH_MAX) q->sqlo[q->nsqlo++] = sqlo;
+  else sqlobj_destroy(sqlo);
+}
+
+void sqlreq_destroy(sqlreq_t *q)
+{
+  int i;
+  for (i = 0; i < q->nsqlo; i++) sqlobj_destroy(q->sqlo[i]);
+  json_free(&q->out);
+  if (q->copy) free(q->copy);
+  if (q->fans) free(q->fans);
+  if (q->zip) free(q->zip);
+  free(q);
+}
+
+/* dispatch the current step, the result is collected by sql_resume() */
+static int _send_step(sqlreq_t *q)
+{
+  PGconn *pgconn = q->slot->conn;
+  char sql[32];
+
+  switch (q->step) {
+    case SQL_STEP_DEALLOC:
+      strcpy(strbld(sql, "DEALLOCATE "), q->evicted);
+      return PQsendQuery(pgconn, sql);
+    case SQL_STEP_PREPARE:
+      return PQsendPrepare(pgconn, q->stmt[0]->name, q->sql, 0, NULL);
+    case SQL_STEP_EXECUTE:
+      /* stream the rows, one PGresult each */
+      return PQsendQueryPrepared(pgconn, q->stmt[0]->name,
+                                 0, NULL, NULL, NULL, q->stmt[0]->format) &&
+             PQsetSingleRowMode(pgconn);
+  }
+  return 0;
+}
+
+static void _step_result(sqlreq_t *q,
+                         PGresult *pgres)
+{
+  ExecStatusType status = PQresultStatus(pgres);
+
+  switch (q->step) {
+    case SQL_STEP_PREPARE:
+      if (status != PGRES_COMMAND_OK) {
+        D_PRINT("PREPARE failed: %s\n", PQresultErrorMessage(pgres));
+        q->failed = 1;
+      }
+      break;
+    case SQL_STEP_EXECUTE:
+      if (status == PGRES_SINGLE_TUPLE) {
+        if (!q->nrows) {
+          _put_head(q, q->sqlo[0], pgres);
+          q->stmt[0]->format = _result_format(pgres);
+        }
+        _put_row(q, pgres, 0, q->nrows++);
+        break;
+      }
+      if (status == PGRES_TUPLES_OK) {
+        /* the end of the result set, it carries no row */
+        if (!q->nrows) {
+          _put_head(q, q->sqlo[0], pgres);
+          q->stmt[0]->format = _result_format(pgres);
+        }
+        json_puts(&q->out, "}}");
+        D_PRINT("[SQL] %ld rows\n", q->nrows);
+        break;
+      }
+      D_PRINT("SELECT failed: %s\n", PQresultErrorMessage(pgres));
+      q->failed = 1;
+      break;
   }
   PQclear(pgres);
+}
 
-  /* execute the prepared statement */
-  pgres = PQexecPrepared(pgconn,
-                         stmt,
-                         0,
-                         NULL,
-                         NULL,
-                         NULL,
-                         0);  /* text result */
-  if (PQresultStatus(pgres) != PGRES_TUPLES_OK) {
-    D_PRINT("SELECT failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
+static int _next_step(sqlreq_t *q)
+{
+  /* a statement which failed is prepared again next time */
+  if (q->failed && q->stmt[0]) {
+    pg_stmt_drop(q->stmt[0]);
+    q->stmt[0] = NULL;
   }
+  if (q->failed) return SQL_STEP_DONE;
+  return q->step + 1;
+}
 
-  /* parse the result set */
-  _parse_result(res, pgres, sqlo->viscols);
-  D_PRINT("[SQL] pg result: %s\n", res);
+/*
+ * start a SELECT without waiting for the database, the caller polls the
+ * socket of the connection and calls sql_resume() when it is readable
+ */
+int sql_send_select(sqlreq_t *q)
+{
+  if (!_prep_select(q->sql, sizeof(q->sql), q->sqlo[0])) return SQL_ERROR;
 
-  /* Deallocate all prepared statements */
-  pgres = PQexec(pgconn, "DEALLOCATE ALL");
-  PQclear(pgres);
+  /* plan once per connection, no transaction needed for a SELECT */
+  q->stmt[0] = pg_stmt_find(q->slot, q->sql);
+  if (q->stmt[0])
+    q->step = SQL_STEP_EXECUTE;
+  else {
+    q->stmt[0] = pg_stmt_add(q->slot, q->sql, q->evicted);
+    q->step = q->evicted[0] ? SQL_STEP_DEALLOC : SQL_STEP_PREPARE;
+  }
 
-  /* end the transaction */
-  pgres = PQexec(pgconn, "END");
-  PQclear(pgres);
+  if (!_send_step(q)) {
+    D_PRINT("[SQL] send failed: %s\n", PQerrorMessage(q->slot->conn));
+    pg_stmt_drop(q->stmt[0]);
+    return SQL_ERROR;
+  }
+  return SQL_WAIT;
+}
+
+static void _add_op(sqlreq_t *q,
+                    const int step,
+                    const int query)
+{
+  q->ops[q->nops].step = step;
+  q->ops[q->nops].query = query;
+  q->nops++;
 }
 
-void _prep_cursor(char *sql,
-                  const sqlobj_t *sqlo)
+/*
+ * send all the queries of the request in one pipeline, the statements
+ * missing from the cache are prepared on the way, and the results come
+ * back in order after a single sync
+ */
+int sql_send_pipeline(sqlreq_t *q)
 {
-  char *ret = strbld(sql, "DECLARE portal CURSOR FOR ");
-  _prep_select(ret, sqlo);
+  PGconn *pgconn = q->slot->conn;
+  char evicted[16];
+  char sql[32];
+  int i;
+
+  /* every statement has to fit before the pipeline starts */
+  for (i = 0; i < q->nsqlo; i++)
+    if (!_prep_select(q->sql, sizeof(q->sql), q->sqlo[i])) return SQL_ERROR;
+  if (!PQenterPipelineMode(pgconn)) return SQL_ERROR;
+
+  for (i = 0; i < q->nsqlo; i++) {
+    _prep_select(q->sql, sizeof(q->sql), q->sqlo[i]);
+
+    q->stmt[i] = pg_stmt_find(q->slot, q->sql);
+    if (!q->stmt[i]) {
+      q->stmt[i] = pg_stmt_add(q->slot, q->sql, evicted);
+      if (evicted[0]) {
+        strcpy(strbld(sql, "DEALLOCATE "), evicted);
+        if (!PQsendQueryParams(pgconn, sql, 0, NULL, NULL, NULL, NULL, 0))
+          return SQL_ERROR;
+        _add_op(q, SQL_STEP_DEALLOC, i);
+      }
+      if (!PQsendPrepare(pgconn, q->stmt[i]->name, q->sql, 0, NULL))
+        return SQL_ERROR;
+      _add_op(q, SQL_STEP_PREPARE, i);
+    }
+
+    if (!PQsendQueryPrepared(pgconn, q->stmt[i]->name,
+                             0, NULL, NULL, NULL, q->stmt[i]->format))
+      return SQL_ERROR;
+    _add_op(q, SQL_STEP_EXECUTE, i);
+  }
+
+  if (!PQpipelineSync(pgconn)) return SQL_ERROR;
+  return SQL_WAIT;
 }
 
-void sql_fetch(char *res,
-               PGconn *pgconn,
-               const sqlobj_t *sqlo)
+static void _pipeline_result(sqlreq_t *q,
+                             PGresult *pgres)
 {
-  char sql[256];
-  _prep_cursor(sql, sqlo);
+  ExecStatusType status = PQresultStatus(pgres);
+  const sqlop_t *op = &q->ops[q->op];
+  int i;
 
-  /* Start a transaction block */
-  PGresult *pgres = PQexec(pgconn, "BEGIN");
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("BEGIN command failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
+  switch (op->step) {
+    case SQL_STEP_PREPARE:
+      if (status == PGRES_COMMAND_OK) break;
+      q->failed = 1;
+      pg_stmt_drop(q->stmt[op->query]);
+      break;
+    case SQL_STEP_EXECUTE:
+      if (status != PGRES_TUPLES_OK) {
+        D_PRINT("SELECT failed: %s\n", PQresultErrorMessage(pgres));
+        q->failed = 1;
+        /* skipped after an earlier error, it is still prepared */
+        if (status != PGRES_PIPELINE_ABORTED) pg_stmt_drop(q->stmt[op->query]);
+        break;
+      }
+      q->stmt[op->query]->format = _result_format(pgres);
+      if (q->failed) break;
+
+      /* the results are the elements of a json array */
+      json_puts(&q->out, op->query ? "," : "[");
+      _put_head(q, q->sqlo[op->query], pgres);
+      for (i = 0; i < PQntuples(pgres); i++) _put_row(q, pgres, i, i);
+      json_puts(&q->out, "}}");
+      q->nrows += i;
+      break;
   }
   PQclear(pgres);
+}
 
-  /* prepare statement name */
-  const char *stmt = "prep_cursor";
-  pgres = PQprepare(pgconn,
-                    stmt,
-                    sql,
-                    0,
-                    NULL);
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("PREPARE failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
+static int _resume_pipeline(sqlreq_t *q)
+{
+  PGconn *pgconn = q->slot->conn;
+
+  while (!PQisBusy(pgconn)) {
+    PGresult *pgres = PQgetResult(pgconn);
+
+    /* the command is complete, the next one follows */
+    if (!pgres) {
+      q->op++;
+      continue;
+    }
+
+    if (PQresultStatus(pgres) == PGRES_PIPELINE_SYNC) {
+      PQclear(pgres);
+      PQexitPipelineMode(pgconn);
+      if (q->failed) return SQL_ERROR;
+      json_puts(&q->out, "]");
+      D_PRINT("[SQL] %d queries, %ld rows\n", q->nsqlo, q->nrows);
+      return SQL_DONE;
+    }
+
+    _pipeline_result(q, pgres);
+    if (q->batch && q->out.len >= q->batch) return SQL_MORE;
   }
-  PQclear(pgres);
 
-  /* execute the prepared statement */
-  pgres = PQexecPrepared(pgconn,
-                         stmt,
-                         0,
-                         NULL,
-                         NULL,
-                         NULL,
-                         0);  /* text result */
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("OPEN CURSOR failed: %s\n", PQerrorMessage(pgconn));
+  return SQL_WAIT;
+}
+
+/*
+ * dump the table of the query with COPY, the database does the
+ * formatting and the rows are only relayed; ndjson is made of
+ * row_to_json() values
+ */
+int sql_send_export(sqlreq_t *q,
+                    const int format)
+{
+  char select[512];
+  _prep_select(select, sizeof(select), q->sqlo[0]);
+
+  char *ret = strbld(q->sql, "COPY (");
+  if (format == SQL_EXPORT_NDJSON) {
+    ret = strbld(ret, "SELECT row_to_json(t) FROM (");
+    ret = strbld(ret, select);
+    ret = strbld(ret, ") t) TO STDOUT");
+  }
+  else {
+    ret = strbld(ret, select);
+    ret = strbld(ret, ") TO STDOUT WITH (FORMAT csv, HEADER)");
+  }
+  *ret++ = '\0';
+
+  q->export = format;
+  q->step = SQL_STEP_EXECUTE;
+  if (!PQsendQueryParams(q->slot->conn, q->sql, 0, NULL, NULL, NULL, NULL, 0)) {
+    D_PRINT("[SQL] send failed: %s\n", PQerrorMessage(q->slot->conn));
+    return SQL_ERROR;
+  }
+  return SQL_WAIT;
+}
+
+/* a row of COPY text format, where json has its backslashes doubled */
+static void _put_copy(sqlreq_t *q,
+                      const char *row,
+                      const int n)
+{
+  if (q->export != SQL_EXPORT_NDJSON) {
+    json_put(&q->out, row, n);
+    return;
+  }
+
+  const char *p = row;
+  const char *end = row + n;
+  const char *bs;
+  while ((bs = memchr(p, '\\', end - p))) {
+    json_put(&q->out, p, bs - p + 1);
+    p = bs + 2;  /* skip the second one */
+    if (p > end) p = end;
+  }
+  json_put(&q->out, p, end - p);
+}
+
+static int _resume_export(sqlreq_t *q)
+{
+  PGconn *pgconn = q->slot->conn;
+  PGresult *pgres;
+  char *row;
+  int n;
+
+  /* the COPY starts with a result of its own */
+  while (q->step == SQL_STEP_EXECUTE) {
+    if (PQisBusy(pgconn)) return SQL_WAIT;
+    pgres = PQgetResult(pgconn);
+    if (!pgres) return SQL_ERROR;
+    if (PQresultStatus(pgres) == PGRES_COPY_OUT)
+      q->step = SQL_STEP_COPY;
+    else {
+      D_PRINT("COPY failed: %s\n", PQresultErrorMessage(pgres));
+      q->failed = 1;
+      q->step = SQL_STEP_DONE;
+    }
     PQclear(pgres);
-    pg_exit_nicely(pgconn);
   }
-  PQclear(pgres);
 
-  pgres = PQexec(pgconn, "FETCH ALL in portal");
-  if (PQresultStatus(pgres) != PGRES_TUPLES_OK) {
-    D_PRINT("FETCH ALL failed: %s\n", PQerrorMessage(pgconn));
+  while (q->step == SQL_STEP_COPY) {
+    n = PQgetCopyData(pgconn, &row, 1);
+    if (n == 0) return SQL_WAIT;
+    if (n == -2) return SQL_ERROR;
+    if (n == -1) {
+      q->step = SQL_STEP_DONE;
+      break;
+    }
+    _put_copy(q, row, n);
+    PQfreemem(row);
+    q->nrows++;
+    if (q->out.len >= q->batch) return SQL_MORE;
+  }
+
+  /* the status of the COPY, then the end of the command */
+  while (!PQisBusy(pgconn)) {
+    pgres = PQgetResult(pgconn);
+    if (!pgres) {
+      D_PRINT("[SQL] exported %ld rows\n", q->nrows);
+      return q->failed ? SQL_ERROR : SQL_DONE;
+    }
+    if (PQresultStatus(pgres) != PGRES_COMMAND_OK) q->failed = 1;
     PQclear(pgres);
-    pg_exit_nicely(pgconn);
+  }
+  return SQL_WAIT;
+}
+
+/*
+ * consume what the database has sent so far and move on to the next step
+ * as each one completes, returns SQL_WAIT until the whole result is in
+ * q->out, or SQL_MORE whenever a batch of rows is ready to go out (the
+ * caller empties q->out and calls again)
+ */
+int sql_resume(sqlreq_t *q)
+{
+  PGconn *pgconn = q->slot->conn;
+
+  /* the rest of the queries first, the socket may have been full */
+  if (PQflush(pgconn) == -1 || !PQconsumeInput(pgconn)) {
+    D_PRINT("[SQL] connection lost: %s\n", PQerrorMessage(pgconn));
+    return SQL_ERROR;
   }
 
-  /* parse the result set */
-  _parse_result(res, pgres, sqlo->viscols);
-  D_PRINT("[SQL] pg result: %s\n", res);
+  if (q->nops) return _resume_pipeline(q);
+  if (q->export) return _resume_export(q);
 
-  /* Deallocate all prepared statements */
-  pgres = PQexec(pgconn, "DEALLOCATE ALL");
-  PQclear(pgres);
+  while (!PQisBusy(pgconn)) {
+    PGresult *pgres = PQgetResult(pgconn);
+    if (pgres) {
+      _step_result(q, pgres);
+      if (q->batch && q->out.len >= q->batch) return SQL_MORE;
+      continue;
+    }
 
-  /* close the portal ... we don't bother to check for errors ... */
-  pgres = PQexec(pgconn, "CLOSE portal");
-  PQclear(pgres);
+    /* the step is complete */
+    q->step = _next_step(q);
+    if (q->step == SQL_STEP_DONE) return q->failed ? SQL_ERROR : SQL_DONE;
+    if (!_send_step(q)) return SQL_ERROR;
+  }
 
-  /* end the transaction */
-  pgres = PQexec(pgconn, "END");
-  PQclear(pgres);
+  return SQL_WAIT;
+}
+
+/*
+ * the blocking flavour, for the callers outside of the event loop,
+ * q->out keeps the whole result when the request has no batch size;
+ * a query past PG_DEADLINE is cancelled, its connection still runs it
+ * so the pool closes it when it is put back
+ */
+int sql_select(sqlreq_t *q)
+{
+  long deadline = mstime() + PG_DEADLINE;
+  int rc = sql_send_select(q);
+
+  while (rc == SQL_WAIT) {
+    struct pollfd pfd;
+    pfd.fd = PQsocket(q->slot->conn);
+    pfd.events = POLLIN;
+    long left = deadline - mstime();
+    int n = left > 0 ? poll(&pfd, 1, left) : 0;
+    if (n == -1 && errno != EINTR) return SQL_ERROR;
+    if (n == 0) {
+      PGcancel *cancel = PQgetCancel(q->slot->conn);
+      if (cancel) pg_cancel(cancel);
+      return SQL_ERROR;
+    }
+    rc = sql_resume(q);
+  }
+  return rc;
 }
@@ -8,13 +8,115 @@
 #define _SQLOPS_
 
 
-void sql_select(char *res,
-                PGconn *pgconn,
-                const sqlobj_t *sqlo);
+/* steps of an async SELECT */
+#define SQL_STEP_DEALLOC 0  /* make room in the statement cache */
+#define SQL_STEP_PREPARE 1
+#define SQL_STEP_EXECUTE 2
+#define SQL_STEP_DONE 3
+#define SQL_STEP_COPY 4     /* relaying the rows of a COPY TO STDOUT */
 
-void sql_fetch(char *res,
-               PGconn *pgconn,
-               const sqlobj_t *sqlo);
+/* status of an async query */
+#define SQL_BUSY -2   /* no connection to run it on */
+#define SQL_ERROR -1
+#define SQL_DONE 0
+#define SQL_WAIT 1
+#define SQL_MORE 2  /* a batch of rows is ready */
+
+#define SQL_BATCH_SIZE 16384  /* rows are sent in chunks of about this */
+#define SQL_ROW_SIZE 1024     /* room for the row which crosses the batch */
+#define SQL_BUF_SIZE 4096     /* initial buffer without batches */
+#define SQL_BATCH_MAX 16      /* queries in a json array */
+
+/* column types, from catalog/pg_type_d.h of the server */
+#define OID_INT8 20
+#define OID_INT2 21
+#define OID_INT4 23
+#define OID_TEXT 25
+#define OID_NAME 19
+#define OID_FLOAT4 700
+#define OID_FLOAT8 701
+#define OID_BPCHAR 1042
+#define OID_VARCHAR 1043
+#define OID_TIMESTAMP 1114
+#define OID_NUMERIC 1700
+
+/* formats of an export */
+#define SQL_EXPORT_CSV 1
+#define SQL_EXPORT_NDJSON 2
+
+
+typedef struct _sqlop sqlop_t;
+
+struct _sqlop {
+  int step;   /* what the command does, SQL_STEP_xxx */
+  int query;  /* the index of its query */
+};
+
+typedef struct _sqlreq sqlreq_t;
+
+struct _sqlreq {
+  pgslot_t *slot;  /* the connection checked out for the queries */
+  sqlobj_t *sqlo[SQL_BATCH_MAX];
+  pgstmt_t *stmt[SQL_BATCH_MAX];  /* their cached statements */
+  int nsqlo;
+  int array;       /* the queries came as a json array, so is the reply */
+  void *cursor;    /* where the backend is in the rows, if it keeps one */
+  int step;
+  int failed;
+  char evicted[16];
+  char sql[512];
+
+  /* the commands sent in pipeline mode */
+  sqlop_t ops[SQL_BATCH_MAX * 3];
+  int nops;
+  int op;          /* the command whose results come in */
+
+  int export;      /* SQL_EXPORT_xxx, the rows come from COPY */
+  struct sdefl *zip;  /* the batches are deflated as they go out */
+  int zlvl;
+
+  /* json result, emptied by the caller batch after batch */
+  jsonbuf_t out;
+  int batch;       /* 0 to keep the whole result */
+  long nrows;
+  long sent;       /* bytes sent to the client */
+
+  /* what was sent, kept for the result cache, NULL if it is not cached */
+  char *copy;
+  int len_copy;
+  int cap_copy;    /* grows with the rows, up to SQLCACHE_ENTRY_MAX */
+  long gen;        /* the cache generation the query started in */
+
+  /* identical requests which take the same reply */
+  struct _flight *flight;     /* until the reply starts */
+  struct _httpconn **fans;
+  int nfans;
+};
+
+
+sqlreq_t *sqlreq_new(pgslot_t *slot,
+                     const int batch);
+
+void sqlreq_add(sqlreq_t *q,
+                sqlobj_t *sqlo);
+
+void sqlreq_destroy(sqlreq_t *q);
+
+int sql_send_select(sqlreq_t *q);
+
+int sql_send_pipeline(sqlreq_t *q);
+
+int sql_send_export(sqlreq_t *q,
+                    const int format);
+
+int sql_resume(sqlreq_t *q);
+
+int sql_select(sqlreq_t *q);
+
+void sql_put_text(jsonbuf_t *jb,
+                  const Oid type,
+                  const char *v,
+                  const int n);
 
 
 #endif
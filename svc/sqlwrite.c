@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <libpq-fe.h>
+#include "util.h"
+#include "arena.h"
+#include "thpool.h"
+#include "pg_conn.h"
+#include "sqlobj.h"
+#include "json.h"
+#include "sqlops.h"
+#include "sqlwrite.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+/* table and column names go into the sql text, the values never do */
+static int _ident(const char *s)
+{
+  if (!*s) return 0;
+  for (; *s; s++)
+    if (!isalnum((unsigned char)*s) && *s != '_') return 0;
+  return 1;
+}
+
+static char *_put_param(char *ret,
+                        const int i)
+{
+  char num[16];
+  itos((unsigned char *)num, i + 1, 10, ' ');
+  ret = strbld(ret, "$");
+  return strbld(ret, num);
+}
+
+/* WHERE a=$n AND b IS NULL ..., the values with it go after the others */
+static char *_put_where(char *ret,
+                        sqlobj_t *sqlo,
+                        const char **params,
+                        int *nparams)
+{
+  int i;
+  ret = strbld(ret, " WHERE ");
+  for (i = 0; i < sqlo->nwhere; i++) {
+    if (i) ret = strbld(ret, " AND ");
+    ret = strbld(ret, sqlo->wkeys[i]);
+    if (!sqlo->wvalues[i]) {
+      ret = strbld(ret, " IS NULL");
+      continue;
+    }
+    ret = strbld(ret, "=");
+    ret = _put_param(ret, *nparams);
+    params[(*nparams)++] = sqlo->wvalues[i];
+  }
+  return ret;
+}
+
+/*
+ * the parameterized statement of an INSERT, UPDATE or DELETE, the values
+ * are sent apart as $1, $2, ...; it is kept in the arena of sqlo along
+ * with the parameters, NULL if the request can't be one; an UPDATE or a
+ * DELETE has to name its rows with "where", a clause is never pasted
+ */
+static char *_prep_write(sqlobj_t *sqlo,
+                         const char ***params,
+                         int *nparams)
+{
+  int i;
+  char *sql;
+  char *ret;
+  size_t need = 32 + strlen(sqlo->table);
+
+  if (!_ident(sqlo->table)) return NULL;
+  if (sqlo->clause[0]) return NULL;
+  /* a key without its value, or the other way round */
+  if (sqlo->nkeys < 0 || sqlo->nvalues < 0 || sqlo->nwhere < 0 ||
+      sqlo->nkeys != sqlo->nvalues)
+    return NULL;
+  for (i = 0; i < sqlo->nkeys; i++) {
+    if (!sqlo->keys[i] || !_ident(sqlo->keys[i])) return NULL;
+    need += strlen(sqlo->keys[i]) + 8;
+  }
+  for (i = 0; i < sqlo->nwhere; i++) {
+    if (!_ident(sqlo->wkeys[i])) return NULL;
+    need += strlen(sqlo->wkeys[i]) + 16;
+  }
+  if (strcmp(sqlo->cmd, "INSERT") != 0 && strcmp(sqlo->cmd, "UPDATE") != 0 &&
+      strcmp(sqlo->cmd, "DELETE") != 0)
+    return NULL;
+  /* never the whole table */
+  if (strcmp(sqlo->cmd, "INSERT") != 0 && !sqlo->nwhere) return NULL;
+
+  sql = arena_alloc(sqlo->arena, need);
+  *params = arena_alloc(sqlo->arena,
+                        (sqlo->nkeys + sqlo->nwhere + 1) * sizeof(char *));
+  if (!sql || !*params) return NULL;
+  for (i = 0; i < sqlo->nkeys; i++) (*params)[i] = sqlo->values[i];
+  *nparams = sqlo->nkeys;
+
+  if (strcmp(sqlo->cmd, "INSERT") == 0) {
+    if (!sqlo->nkeys || sqlo->nwhere) return NULL;
+    ret = strbld(sql, "INSERT INTO ");
+    ret = strbld(ret, sqlo->table);
+    ret = strbld(ret, " (");
+    for (i = 0; i < sqlo->nkeys; i++) {
+      if (i) ret = strbld(ret, ",");
+      ret = strbld(ret, sqlo->keys[i]);
+    }
+    ret = strbld(ret, ") VALUES (");
+    for (i = 0; i < sqlo->nkeys; i++) {
+      if (i) ret = strbld(ret, ",");
+      ret = _put_param(ret, i);
+    }
+    ret = strbld(ret, ")");
+  }
+  else if (strcmp(sqlo->cmd, "UPDATE") == 0) {
+    if (!sqlo->nkeys) return NULL;
+    ret = strbld(sql, "UPDATE ");
+    ret = strbld(ret, sqlo->table);
+    ret = strbld(ret, " SET ");
+    for (i = 0; i < sqlo->nkeys; i++) {
+      if (i) ret = strbld(ret, ",");
+      ret = strbld(ret, sqlo->keys[i]);
+      ret = strbld(ret, "=");
+      ret = _put_param(ret, i);
+    }
+    ret = _put_where(ret, sqlo, *params, nparams);
+  }
+  else {
+    if (sqlo->nkeys) return NULL;
+    ret = strbld(sql, "DELETE FROM ");
+    ret = strbld(ret, sqlo->table);
+    ret = _put_where(ret, sqlo, *params, nparams);
+  }
+
+  return sql;
+}
+
+static int _exec(PGconn *conn,
+                 const char *sql)
+{
+  PGresult *res = PQexec(conn, sql);
+  int ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+  if (!ok) D_PRINT("[SQLW] %s failed: %s\n", sql, PQerrorMessage(conn));
+  PQclear(res);
+  return ok;
+}
+
+/* run a write with the statement cached on the slot, in the transaction */
+static int _run(pgslot_t *slot,
+                sqlwrite_t *wr)
+{
+  PGconn *conn = slot->conn;
+  char evicted[16];
+  char sql[32];
+
+  pgstmt_t *stmt = pg_stmt_find(slot, wr->sql);
+  if (!stmt) {
+    stmt = pg_stmt_add(slot, wr->sql, evicted);
+    if (evicted[0]) {
+      strcpy(strbld(sql, "DEALLOCATE "), evicted);
+      if (!_exec(conn, sql)) {
+        /* never prepared, the slot must not keep it */
+        pg_stmt_drop(stmt);
+        return 0;
+      }
+    }
+    PGresult *res = PQprepare(conn, stmt->name, wr->sql, 0, NULL);
+    int ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+    PQclear(res);
+    if (!ok) {
+      pg_stmt_drop(stmt);
+      return 0;
+    }
+  }
+
+  PGresult *res = PQexecPrepared(conn, stmt->name, wr->nparams,
+                                 wr->params, NULL, NULL, 0);
+  int ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+  if (ok) wr->nrows = atol(PQcmdTuples(res));
+  else D_PRINT("[SQLW] %s failed: %s\n", wr->sql, PQresultErrorMessage(res));
+  PQclear(res);
+  return ok;
+}
+
+/* the reply is written by a worker, the writer thread only talks to the db */
+static void _reply(void *arg)
+{
+  sqlwrite_t *wr = (sqlwrite_t *)arg;
+  wr->done(wr->arg, wr->sqlo, wr->rc, wr->nrows);
+  sqlobj_destroy(wr->sqlo);
+  free(wr);
+}
+
+/*
+ * commit the batch in one transaction; a write which fails aborts it, so
+ * it is answered with an error and the transaction is run once more, with
+ * a savepoint before each write this time, so a failure costs one rollback
+ */
+static void _commit(sqlwriter_t *w,
+                    sqlwrite_t *batch)
+{
+  sqlwrite_t *wr;
+  pgslot_t *slot = pg_pool_get(w->pool, PG_POOL_WAIT);
+  int safe = 0;
+
+  while (slot) {
+    sqlwrite_t *failed = NULL;
+
+    if (!_exec(slot->conn, "BEGIN")) break;
+    for (wr = batch; wr; wr = wr->next) {
+      if (wr->rc != SQL_WAIT) continue;
+      if (safe && !_exec(slot->conn, "SAVEPOINT w")) break;
+      if (_run(slot, wr)) continue;
+      if (!safe) {
+        failed = wr;
+        break;
+      }
+      wr->rc = SQL_ERROR;
+      if (!_exec(slot->conn, "ROLLBACK TO SAVEPOINT w")) break;
+    }
+
+    if (failed || wr) {
+      _exec(slot->conn, "ROLLBACK");
+      if (!failed) break;
+      failed->rc = SQL_ERROR;
+      safe = 1;
+      continue;
+    }
+
+    if (_exec(slot->conn, "COMMIT")) {
+      __sync_fetch_and_add(&w->ncommits, 1);
+      for (wr = batch; wr; wr = wr->next)
+        if (wr->rc == SQL_WAIT) wr->rc = SQL_DONE;
+    }
+    break;
+  }
+  if (slot) pg_pool_put(w->pool, slot);
+
+  /* the writes left are the ones the database didn't take */
+  while (batch) {
+    wr = batch;
+    batch = wr->next;
+    if (wr->rc == SQL_WAIT) wr->rc = SQL_ERROR;
+    thpool_add_task(w->tasks, _reply, wr);
+  }
+}
+
+static void *_writer(void *arg)
+{
+  sqlwriter_t *w = (sqlwriter_t *)arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (w->running || w->head) {
+    if (!w->head) {
+      pthread_cond_wait(&w->cond, &w->lock);
+      continue;
+    }
+
+    /* give the concurrent writes the window to join the transaction */
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += SQLW_WINDOW * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    while (w->running && w->nqueued < SQLW_BATCH_MAX &&
+           pthread_cond_timedwait(&w->cond, &w->lock, &until) == 0);
+
+    /* take up to SQLW_BATCH_MAX of them */
+    sqlwrite_t *batch = w->head;
+    sqlwrite_t *last = batch;
+    int n = 1;
+    while (last->next && n < SQLW_BATCH_MAX) {
+      last = last->next;
+      n++;
+    }
+    w->head = last->next;
+    if (!w->head) w->tail = NULL;
+    last->next = NULL;
+    w->nqueued -= n;
+    pthread_mutex_unlock(&w->lock);
+
+    D_PRINT("[SQLW] committing %d writes\n", n);
+    _commit(w, batch);
+
+    pthread_mutex_lock(&w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+sqlwriter_t *sqlwriter_new(pgpool_t *pool,
+                           thpool_t *tasks)
+{
+  sqlwriter_t *w = calloc(1, sizeof(struct _sqlwriter));
+  w->pool = pool;
+  w->tasks = tasks;
+  w->running = 1;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if (pthread_create(&w->tid, NULL, _writer, w) != 0) {
+    perror("pthread_create()");
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+/* the writes already queued are committed first */
+void sqlwriter_destroy(sqlwriter_t *w)
+{
+  pthread_mutex_lock(&w->lock);
+  w->running = 0;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->tid, NULL);
+
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  free(w);
+}
+
+/*
+ * queue an INSERT, UPDATE or DELETE for the next group commit, the writer
+ * owns sqlo from now on and calls done once it is committed; returns 0
+ * (sqlo untouched) if it is not a valid write
+ */
+int sql_write(sqlwriter_t *w,
+              sqlobj_t *sqlo,
+              sqlw_done_fn done,
+              void *arg)
+{
+  const char **params;
+  int nparams;
+  char *sql = _prep_write(sqlo, &params, &nparams);
+  if (!sql) return 0;
+
+  sqlwrite_t *wr = calloc(1, sizeof(struct _sqlwrite));
+  wr->sql = sql;
+  wr->params = params;
+  wr->nparams = nparams;
+  wr->sqlo = sqlo;
+  wr->done = done;
+  wr->arg = arg;
+  wr->rc = SQL_WAIT;
+  __sync_fetch_and_add(&w->nwrites, 1);
+
+  pthread_mutex_lock(&w->lock);
+  if (w->tail) w->tail->next = wr;
+  else w->head = wr;
+  w->tail = wr;
+  w->nqueued++;
+  if (w->nqueued == 1 || w->nqueued >= SQLW_BATCH_MAX)
+    pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  return 1;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * The code is licensed under the MIT license
+ */
+
+#ifndef _SQLWRITE_
+#define _SQLWRITE_
+
+
+#define SQLW_WINDOW 2         /* ms, writes gathered into one transaction */
+#define SQLW_BATCH_MAX 256    /* writes in a transaction */
+
+
+/* called on a worker of the pool once the write is committed or has failed */
+typedef void (*sqlw_done_fn)(void *arg,
+                             const sqlobj_t *sqlo,
+                             const int rc,
+                             const long nrows);
+
+typedef struct _sqlwrite sqlwrite_t;
+
+struct _sqlwrite {
+  sqlobj_t *sqlo;
+  char *sql;       /* in the arena of sqlo, so are the params */
+  const char **params;  /* the values, then those of the where */
+  int nparams;
+  sqlw_done_fn done;
+  void *arg;
+  int rc;          /* SQL_DONE, SQL_ERROR, or SQL_WAIT until it is run */
+  long nrows;
+  struct _sqlwrite *next;
+};
+
+typedef struct _sqlwriter sqlwriter_t;
+
+struct _sqlwriter {
+  pgpool_t *pool;
+  struct _thpool *tasks;  /* the replies are sent from there */
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  sqlwrite_t *head;
+  sqlwrite_t *tail;
+  int nqueued;
+  int running;
+
+  /* metrics */
+  volatile long ncommits;
+  volatile long nwrites;
+};
+
+
+sqlwriter_t *sqlwriter_new(pgpool_t *pool,
+                           struct _thpool *tasks);
+
+void sqlwriter_destroy(sqlwriter_t *w);
+
+int sql_write(sqlwriter_t *w,
+              sqlobj_t *sqlo,
+              sqlw_done_fn done,
+              void *arg);
+
+
+#endif
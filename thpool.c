@@ -15,6 +15,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
 #include "thpool.h"
 
 //#define DEBUG
@@ -23,6 +24,14 @@
 
 const int TASK_QUEUE_MAX = 10000;
 
+/* monotonic time in microseconds */
+static long _now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void *_worker_func(void *pool_arg)
 {
   D_PRINT("[W] Starting work thread.\n");
@@ -45,6 +54,9 @@ static void *_worker_func(void *pool_arg)
     picked_task = pool->task_queue[pool->queue_head % TASK_QUEUE_MAX];
     pool->queue_head++;
 
+    /* 1/8 weighted moving average of the queueing delay */
+    pool->qdelay += (_now() - picked_task.stamp - pool->qdelay) / 8;
+
     /* The task is scheduled */
     pool->scheduled++;
 
@@ -90,6 +102,7 @@ void thpool_add_task(struct _thpool *pool,
   struct _taskdata task;
   task.work_routine = work_routine;
   task.arg = arg;
+  task.stamp = _now();
 
   pool->task_queue[pool->queue_tail % TASK_QUEUE_MAX] = task;
   pool->queue_tail++;
@@ -99,6 +112,11 @@ void thpool_add_task(struct _thpool *pool,
   assert(rc == 0);
 }
 
+long thpool_qdelay(struct _thpool *pool)
+{
+  return pool->qdelay / 1000;
+}
+
 void thpool_wait(struct _thpool *pool)
 {
   D_PRINT("[POOL] Waiting for completion.\n");
@@ -121,6 +139,7 @@ struct _thpool *thpool_init(const int max_threads)
 
   pool->queue_head = pool->queue_tail = 0;
   pool->scheduled = 0;
+  pool->qdelay = 0;
   pool->task_queue = malloc(sizeof(struct _taskdata) * TASK_QUEUE_MAX);
 
   pool->max_threads = max_threads;
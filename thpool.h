@@ -17,6 +17,7 @@
 struct _taskdata {
   void (*work_routine)(void *);
   void *arg;
+  long stamp;  /* time queued (us) */
 };
 
 
@@ -47,6 +48,9 @@ struct _thpool {
    */
   int scheduled;
 
+  /* moving average of the time tasks wait in the queue (us) */
+  long qdelay;
+
   pthread_mutex_t mutex;
 
   /*
@@ -71,6 +75,9 @@ void thpool_add_task(thpool_t *pool,
                      void (*work_routine)(void *),
                      void *arg);
 
+/* Average time (ms) the recent tasks waited in the queue */
+long thpool_qdelay(thpool_t *pool);
+
 /* Blocks until the thread pool is done executing its tasks */
 void thpool_wait(thpool_t *pool);
 
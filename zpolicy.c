@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "deflate.h"
+#include "mime.h"
+#include "zpolicy.h"
+
+//#define DEBUG
+#include "debug.h"
+
+
+struct _zrule {
+  const char *ctype;  /* content type prefix */
+  int lvl;
+};
+
+/* per MIME levels, the first matching prefix wins */
+static const struct _zrule rules[] = {
+  /* already compressed formats */
+  {"image/png", ZP_NONE},
+  {"image/jpeg", ZP_NONE},
+  {"image/gif", ZP_NONE},
+  {"image/webp", ZP_NONE},
+  {"application/gzip", ZP_NONE},
+  {"application/zip", ZP_NONE},
+  {"application/pdf", ZP_NONE},
+  {"font/woff", ZP_NONE},
+  {"audio/", ZP_NONE},
+  {"video/", ZP_NONE},
+  /* compressible, cached once so spend some more cpu on them */
+  {"text/html", 6},
+  {"text/css", 6},
+  {"text/javascript", 6},
+  {"image/svg+xml", 6},
+  {"application/json", SDEFL_LVL_DEF},
+  {"text/plain", SDEFL_LVL_DEF},
+  {NULL, 0}
+};
+
+/* how many levels the load takes off */
+static volatile int zp_bias = 0;
+
+
+int zpolicy_level(const char *ctype,
+                  const int mtype,
+                  const size_t len)
+{
+  int lvl = mtype == MIME_TXT ? SDEFL_LVL_DEF : ZP_NONE;
+  const struct _zrule *r = rules;
+
+  if (len < ZP_MIN_SIZE) return ZP_NONE;
+
+  while (r->ctype) {
+    if (strncmp(ctype, r->ctype, strlen(r->ctype)) == 0) {
+      lvl = r->lvl;
+      break;
+    }
+    r++;
+  }
+  if (lvl == ZP_NONE) return ZP_NONE;
+
+  lvl -= zp_bias;
+  return lvl < SDEFL_LVL_MIN ? SDEFL_LVL_MIN : lvl;
+}
+
+void zpolicy_adapt(const long qdelay,
+                   const int ncores)
+{
+  double load = 0;
+  if (getloadavg(&load, 1) == 1) load /= ncores;
+
+  if (qdelay > ZP_DELAY_HIGH || load > ZP_LOAD_HIGH) {
+    if (zp_bias < SDEFL_LVL_MAX) zp_bias++;
+    D_PRINT("[ZIP] busy (%ld ms, %.2f), level bias %d\n", qdelay, load, zp_bias);
+  }
+  else if (qdelay < ZP_DELAY_LOW && load < ZP_LOAD_LOW) {
+    if (zp_bias > 0) zp_bias--;
+  }
+}
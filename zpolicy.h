@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * license: MIT license
+ */
+
+#ifndef _ZPOLICY_H_
+#define _ZPOLICY_H_
+
+
+#define ZP_NONE -1           /* don't compress */
+#define ZP_MIN_SIZE 256      /* smaller bodies are sent as they are */
+
+/* load watermarks of the adaptive level */
+#define ZP_DELAY_HIGH 50     /* thread pool queue delay (ms) */
+#define ZP_DELAY_LOW 5
+#define ZP_LOAD_HIGH 0.9     /* loadavg per core */
+#define ZP_LOAD_LOW 0.5
+
+
+/*
+ * compression level of a body of the given content type and length,
+ * ZP_NONE if it should not be compressed
+ */
+int zpolicy_level(const char *ctype,
+                  const int mtype,
+                  const size_t len);
+
+/*
+ * called periodically with the thread pool queue delay (ms), lowers the
+ * levels when the server is busy and restores them when it is idle
+ */
+void zpolicy_adapt(const long qdelay,
+                   const int ncores);
+
+
+#endif